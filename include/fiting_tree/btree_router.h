@@ -0,0 +1,85 @@
+#ifndef BTREE_ROUTER_H
+#define BTREE_ROUTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include <functional>
+
+#include "stx/btree.h"
+
+/**
+ * The BTreeRouter type maps a key to the segment responsible for it using an STX B+ Tree keyed by the
+ * start keys of the segments. It is the default routing structure of the FITing-Tree.
+ *
+ * @tparam KeyType - The type of the indexed keys
+ */
+template <typename KeyType>
+class BTreeRouter
+{
+    using segment_id = uint32_t;
+    using tree_pair_type = std::pair<KeyType, segment_id>;
+
+    stx::btree<KeyType,
+               segment_id,
+               tree_pair_type,
+               std::greater<KeyType>,
+               stx::btree_default_map_traits<KeyType, segment_id>,
+               false,
+               std::allocator<tree_pair_type>,
+               false>
+        tree; // STX B+ Tree mapping the start key of every segment to its index
+
+public:
+    BTreeRouter() = default;
+
+    /**
+     * Constructs the router on the start keys of the segments.
+     * @param first, last the range containing the start keys, must be sorted and unique
+     */
+    template <typename RandomIt>
+    BTreeRouter(RandomIt first, RandomIt last) : tree()
+    {
+        size_t num_segments = std::distance(first, last);
+        if (num_segments > std::numeric_limits<segment_id>::max())
+            throw std::length_error("the number of segments exceeds the range of segment ids");
+
+        // The tree is ordered by decreasing start key
+        std::vector<tree_pair_type> formatted_segments;
+        formatted_segments.reserve(num_segments);
+        for (size_t i = num_segments; i > 0; --i)
+        {
+            formatted_segments.emplace_back(first[i - 1], segment_id(i - 1));
+        }
+
+        tree.bulk_load(formatted_segments.begin(), formatted_segments.end());
+    }
+
+    /**
+     * Returns the index of the segment with the largest start key not greater than the given key.
+     * @param key a key not smaller than the first start key
+     * @return the index of the segment
+     */
+    size_t find(const KeyType &key) const
+    {
+        return tree.lower_bound(key).data();
+    }
+
+    /**
+     * Finds the segments of a batch of keys.
+     * @param queries the keys, each not smaller than the first start key
+     * @param count the number of keys
+     * @param out the array receiving the indices of the segments
+     */
+    void find_batch(const KeyType *queries, size_t count, size_t *out) const
+    {
+        // The nodes of the STX B+ Tree are not exposed, so its descents cannot be interleaved
+        for (size_t j = 0; j < count; ++j)
+            out[j] = find(queries[j]);
+    }
+};
+
+#endif
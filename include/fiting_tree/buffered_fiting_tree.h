@@ -4,16 +4,28 @@
 #include <cstddef>
 #include <cassert>
 #include <vector>
-#include <map>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <algorithm>
 
 #include "buffered_segment.h"
+#include "gapped_segment.h"
+#include "merge_worker.h"
 #include "piecewise_linear_model.h"
+#include "segment_arena.h"
 #include "stx/btree.h"
 
 #define ADD_ERR(x, error, size) ((x) + (error) >= (size) ? (size) : (x) + (error))
 #define SUB_ERR(x, error) ((x) <= (error) ? 0 : ((x) - (error)))
 
-template <typename KeyType, typename PosType, uint64_t Error = 64, uint64_t BufferSize = 32, typename Floating = long double>
+template <typename KeyType,
+          typename PosType,
+          uint64_t Error = 64,
+          uint64_t BufferSize = 32,
+          typename Floating = DefaultSlope<KeyType>,
+          typename SegmentType = BufferedSegment<KeyType, PosType, Floating, BufferSize>,
+          typename Segmentation = ShrinkingCone>
 class BufferedFitingTree
 {
     static_assert(Error > 0);
@@ -22,180 +34,815 @@ class BufferedFitingTree
 
     class BufferedFitingTreeIterator;
 
+    using segment_type = SegmentType;
+    using allocator_type = typename SegmentType::allocator_type;
+
+    template <typename T>
+    using rebind_alloc = typename std::allocator_traits<allocator_type>::template rebind_alloc<T>;
+
+    using arena_type = SegmentArena<segment_type, rebind_alloc<segment_type>>;
+    using segment_id = typename arena_type::id_type;
+    using tree_type = stx::btree<KeyType,
+                                 segment_id,
+                                 std::pair<KeyType, segment_id>,
+                                 std::greater<KeyType>,
+                                 stx::btree_default_map_traits<KeyType, segment_id>,
+                                 false,
+                                 rebind_alloc<std::pair<KeyType, segment_id>>,
+                                 false>;
+
 private:
-    size_t n;
-    KeyType start_key;
-    std::vector<BufferedSegment<KeyType, PosType>> segments;
-    stx::btree<KeyType,
-               BufferedSegment<KeyType, PosType>,
-               std::pair<KeyType, BufferedSegment<KeyType, PosType>>,
-               std::greater<KeyType>,
-               stx::btree_default_map_traits<KeyType, BufferedSegment<KeyType, PosType>>,
-               false,
-               std::allocator<std::pair<KeyType, BufferedSegment<KeyType, PosType>>>,
-               false>
-        buffered_fiting_tree;
+    size_t n = 0;
+    KeyType start_key{};
+    allocator_type allocator;       // Allocates the segments, the tree and the scratch buffers
+    arena_type segments;            // Owns the segments
+    tree_type buffered_fiting_tree; // Maps the start key of every segment to its id in segments
+    size_t max_segment_size = std::numeric_limits<size_t>::max(); // The maximum number of keys stored in a segment
 
 public:
     static constexpr uint64_t error_value = Error;
     static constexpr uint64_t seg_error = Error - BufferSize;
     static constexpr uint64_t buffer_size = BufferSize;
+    static constexpr double max_deleted_ratio = 0.5;    // The fraction of deleted items that triggers a compaction
+    static constexpr uint64_t small_segment_size = Error; // Smaller neighbours are merged in a compacted segment
 
     using iterator = BufferedFitingTreeIterator;
     using pair_type = typename std::pair<KeyType, PosType>;
-    using tree_pair_type = typename std::pair<KeyType, BufferedSegment<KeyType, PosType>>;
+    using tree_pair_type = typename std::pair<KeyType, segment_type>;
+    using pair_vector = std::vector<pair_type, rebind_alloc<pair_type>>;
+    using segment_vector = std::vector<tree_pair_type, rebind_alloc<tree_pair_type>>;
 
     BufferedFitingTree() = default;
 
-    explicit BufferedFitingTree(const std::vector<KeyType> &data) : BufferedFitingTree(data.begin(), data.end()) {}
-
+    /**
+     * Constructs the index on the given sorted data.
+     * @param data the vector of keys, must be sorted
+     * @param max_segment_size the maximum number of keys stored in a segment, 0 means no limit. Smaller
+     *        segments bound the cost of merging a buffer or rebuilding a segment, at the price of more
+     *        segments in the routing tree
+     * @param alloc the allocator of the segments, also rebound for the routing tree and the buffers of the
+     *        merges, see SegmentType::allocator_type. With background merges, the allocator is also used by
+     *        the merge thread, concurrently with the calling thread, so its resource must be thread-safe
+     *        (e.g. SizeClassPool or std::pmr::synchronized_pool_resource, but not an unsynchronized_pool_resource
+     *        or a monotonic_buffer_resource)
+     */
+    explicit BufferedFitingTree(const std::vector<KeyType> &data, size_t max_segment_size = 0, const allocator_type &alloc = allocator_type())
+        : BufferedFitingTree(data.begin(), data.end(), max_segment_size, alloc) {}
+
+    /**
+     * Constructs the index on the sorted data in the range [first, last).
+     * @param first, last the range containing the sorted elements to be indexed
+     * @param max_segment_size the maximum number of keys stored in a segment, 0 means no limit
+     * @param alloc the allocator of the segments, thread-safe if background merges are enabled
+     */
     template <typename RandomIt>
-    BufferedFitingTree(RandomIt first, RandomIt last)
-        : n(std::distance(first, last)), start_key(*first), segments(), buffered_fiting_tree()
+    BufferedFitingTree(RandomIt first, RandomIt last, size_t max_segment_size = 0, const allocator_type &alloc = allocator_type())
+        : n(std::distance(first, last)), start_key(first == last ? KeyType() : *first), allocator(alloc), segments(alloc), buffered_fiting_tree(alloc),
+          max_segment_size(max_segment_size == 0 ? std::numeric_limits<size_t>::max() : max_segment_size)
     {
         assert(std::is_sorted(first, last));
 
         if (n == 0)
             return;
 
-        std::vector<tree_pair_type> formatted_segments;
-        size_t num_segments;
+        load_segments(n, [first](auto i) { return pair_type(first[i], i); });
+    }
+
+    /**
+     * Copies an index. The merges in progress in other are not copied, since its segments still hold all
+     * its items, and the copy has no merge worker, see set_background_merges.
+     * @param other the index to copy
+     * @param alloc the allocator of the copy
+     */
+    BufferedFitingTree(const BufferedFitingTree &other, const allocator_type &alloc)
+        : n(other.n), start_key(other.start_key), allocator(alloc), segments(other.segments, alloc), buffered_fiting_tree(alloc),
+          max_segment_size(other.max_segment_size), merge_step(other.merge_step)
+    {
+        copy_routing(other.buffered_fiting_tree);
+    }
+
+    BufferedFitingTree(const BufferedFitingTree &other)
+        : BufferedFitingTree(other, std::allocator_traits<allocator_type>::select_on_container_copy_construction(other.allocator)) {}
+
+    /**
+     * Moves an index, together with its merges in progress and its merge worker. other is left empty.
+     * @param other the index to move
+     */
+    BufferedFitingTree(BufferedFitingTree &&other)
+        : n(other.n), start_key(other.start_key), allocator(other.allocator), segments(std::move(other.segments)),
+          buffered_fiting_tree(other.allocator), max_segment_size(other.max_segment_size), merge_step(other.merge_step),
+          pending(std::move(other.pending)), merge_worker(std::move(other.merge_worker)), background(std::move(other.background)),
+          next_job_id(other.next_job_id)
+    {
+        buffered_fiting_tree.swap(other.buffered_fiting_tree);
+        other.clear();
+    }
+
+    /**
+     * Replaces the content of the index with a copy of other, see the copy constructor. The merges in
+     * progress in this index are dropped and its merge worker is stopped, while its allocator is kept.
+     * @param other the index to copy
+     * @return this index
+     */
+    BufferedFitingTree &operator=(const BufferedFitingTree &other)
+    {
+        if (this == &other)
+            return *this;
+
+        arena_type copied_segments(other.segments, allocator);
+        clear();
+        segments = std::move(copied_segments);
+        copy_routing(other.buffered_fiting_tree);
+        n = other.n;
+        start_key = other.start_key;
+        max_segment_size = other.max_segment_size;
+        merge_step = other.merge_step;
+        return *this;
+    }
+
+    /**
+     * Replaces the content of the index with the one of other, together with its merges in progress and its
+     * merge worker, see the move constructor. The index is copied instead if the allocators differ.
+     * @param other the index to move
+     * @return this index
+     */
+    BufferedFitingTree &operator=(BufferedFitingTree &&other)
+    {
+        if (this == &other)
+            return *this;
+
+        if (!(allocator == other.allocator))
+            return *this = other;
+
+        clear();
+        segments = std::move(other.segments);
+        buffered_fiting_tree.swap(other.buffered_fiting_tree);
+        n = other.n;
+        start_key = other.start_key;
+        max_segment_size = other.max_segment_size;
+        merge_step = other.merge_step;
+        if (other.pending)
+            pending.emplace(std::move(*other.pending));
+        merge_worker = std::move(other.merge_worker);
+        background = std::move(other.background);
+        next_job_id = other.next_job_id;
+        other.clear();
+        return *this;
+    }
+
+private:
+    static constexpr size_t batch_group_size = 32; // The number of lookups interleaved by find_batch
+
+    /**
+     * A segment being rebuilt a few items at a time, see set_merge_step. The old segment keeps serving all
+     * the operations, and the keys written after their item was copied are replayed on the new segments.
+     */
+    struct PendingMerge
+    {
+        KeyType segment_key;                              // The start key of the segment being rebuilt
+        bool copied;                                      // Whether the cursor refers to a copied item
+        KeyType cursor;                                   // The key of the last item copied
+        BufferedSegmenter<Floating, segment_type, Segmentation> segmenter;
+        segment_vector formatted_segments;                // The new segments completed so far
+        std::vector<KeyType, rebind_alloc<KeyType>> written; // The keys written after their item was copied
+
+        PendingMerge(const KeyType &segment_key, size_t max_segment_size, const allocator_type &alloc)
+            : segment_key(segment_key), copied(false), cursor(), segmenter(seg_error, max_segment_size, alloc),
+              formatted_segments(alloc), written(alloc) {}
+    };
+
+    /**
+     * A segment rebuilt by the merge worker from a copy of its items, see set_background_merges. The keys
+     * written after the copy are replayed on the new segments.
+     */
+    struct BackgroundMerge
+    {
+        size_t id;                                           // The id of the job of the merge worker
+        KeyType segment_key;                                 // The start key of the segment being rebuilt
+        std::vector<KeyType, rebind_alloc<KeyType>> written; // The keys written after the copy
+    };
+
+    struct MergeJob
+    {
+        size_t id;
+        size_t max_segment_size;
+        pair_vector items; // The live items of the segment
+    };
+
+    using merge_result_type = std::pair<size_t, segment_vector>;
+    using merge_worker_type = MergeWorker<MergeJob, merge_result_type (*)(MergeJob &)>;
+
+    size_t merge_step = 0;
+    std::optional<PendingMerge> pending;
+    std::unique_ptr<merge_worker_type> merge_worker;
+    std::vector<BackgroundMerge, rebind_alloc<BackgroundMerge>> background{allocator}; // The merges submitted to the worker and not yet applied
+    size_t next_job_id = 0;
+
+    // Reused by the merges of the buffers and the compactions, so that they allocate only while the index grows
+    pair_vector scratch_items{allocator};
+    segment_vector scratch_segments{allocator};
+
+    /**
+     * Segments the given items and appends the segments paired with their start keys to a vector, in
+     * increasing order. The segments get the allocator of the vector.
+     */
+    template <typename Fin>
+    static void make_segments(size_t count, Fin in, size_t max_segment_size, segment_vector &formatted_segments)
+    {
+        auto out_fun = [&formatted_segments](auto segment) { formatted_segments.emplace_back(segment.get_start_key(), std::move(segment)); };
+        get_all_segments_buffered<Floating, segment_type, Segmentation>(count, seg_error, in, out_fun, max_segment_size,
+                                                          allocator_type(formatted_segments.get_allocator()));
+    }
+
+    /**
+     * Fills the empty tree with the segments of the given items. Every segment is built from the items in
+     * place and moved once, into the arena, and the tree is then bulk loaded with the ids of the segments.
+     */
+    template <typename Fin>
+    void load_segments(size_t count, Fin in)
+    {
+        std::vector<std::pair<KeyType, segment_id>, rebind_alloc<std::pair<KeyType, segment_id>>> entries(allocator);
+        auto out_fun = [this, &entries](auto segment) { entries.emplace_back(segment.get_start_key(), segments.insert(std::move(segment))); };
+        get_all_segments_buffered<Floating, segment_type, Segmentation>(count, seg_error, in, out_fun, max_segment_size, allocator);
+
+        // The tree is ordered by decreasing start key
+        std::reverse(entries.begin(), entries.end());
+        buffered_fiting_tree.bulk_load(entries.begin(), entries.end());
+    }
+
+    /**
+     * Builds the first segment of an empty index from a single item, since there is no segment to route
+     * it to.
+     */
+    void insert_first(const KeyType &key, const PosType &pos)
+    {
+        n = 1;
+        start_key = key;
+        pair_type item(key, pos);
+        load_segments(1, [&item](auto) { return item; });
+    }
+
+    /**
+     * Adds the given segments to the tree.
+     */
+    template <typename InputIt>
+    void insert_segments(InputIt first, InputIt last)
+    {
+        for (; first != last; ++first)
+            buffered_fiting_tree.insert(first->first, segments.insert(std::move(first->second)));
+    }
+
+    /**
+     * Removes a segment from the tree and destroys it.
+     */
+    void erase_segment(typename tree_type::iterator it)
+    {
+        segments.erase(it.data());
+        buffered_fiting_tree.erase(it);
+    }
+
+    /**
+     * Fills the empty tree with the entries of another tree, whose ids refer to a copy of its arena.
+     */
+    void copy_routing(const tree_type &other)
+    {
+        std::vector<std::pair<KeyType, segment_id>, rebind_alloc<std::pair<KeyType, segment_id>>> entries(other.begin(), other.end(), allocator);
+        buffered_fiting_tree.bulk_load(entries.begin(), entries.end());
+    }
+
+    /**
+     * Empties the index, dropping its merges in progress and stopping its merge worker.
+     */
+    void clear()
+    {
+        pending.reset();
+        background.clear();
+        merge_worker.reset();
+        buffered_fiting_tree.clear();
+        segments.clear();
+        n = 0;
+    }
+
+    /**
+     * Runs a job of the merge worker, on its thread.
+     */
+    static merge_result_type run_merge_job(MergeJob &job)
+    {
+        auto &items = job.items;
+        segment_vector formatted_segments(items.get_allocator());
+        make_segments(items.size(), [&items](auto i) { return items[i]; }, job.max_segment_size, formatted_segments);
+        return {job.id, std::move(formatted_segments)};
+    }
+
+    /**
+     * Rebuilds a segment from its items that are not deleted, together with its neighbours that hold
+     * fewer than small_segment_size of them, so that their keys are covered again by as few segments as
+     * the error allows. The index keeps at least one segment.
+     */
+    void compact(typename tree_type::iterator it)
+    {
+        auto is_small = [](const segment_type &segment) { return segment.size() - segment.deleted_count() < small_segment_size; };
+
+        // The tree is ordered by decreasing start key, so the next segment in it precedes this one
+        auto first = it;
+        auto last = it;
+        if (std::next(it) != buffered_fiting_tree.end() && is_small(segments[std::next(it).data()]))
+            ++first;
+        if (it != buffered_fiting_tree.begin() && is_small(segments[std::prev(it).data()]))
+            --last;
+
+        auto &items = scratch_items;
+        items.clear();
+        std::vector<KeyType, rebind_alloc<KeyType>> start_keys(allocator);
+        for (auto segment_it = first;; --segment_it)
+        {
+            segments[segment_it.data()].append_live_items(items);
+            start_keys.push_back(segment_it.key());
+            if (segment_it == last)
+                break;
+        }
+
+        if (items.empty() && start_keys.size() == buffered_fiting_tree.size())
+            return;
+
+        // The merges of the rebuilt segments are dropped
+        auto rebuilt = [&start_keys](const KeyType &key) { return std::find(start_keys.begin(), start_keys.end(), key) != start_keys.end(); };
+        if (pending && rebuilt(pending->segment_key))
+            pending.reset();
+        background.erase(std::remove_if(background.begin(), background.end(), [&](auto &merge) { return rebuilt(merge.segment_key); }),
+                         background.end());
+
+        for (auto &key : start_keys)
+            erase_segment(buffered_fiting_tree.find(key));
+
+        auto &formatted_segments = scratch_segments;
+        formatted_segments.clear();
+        make_segments(items.size(), [&items](auto i) { return items[i]; }, max_segment_size, formatted_segments);
+        insert_segments(formatted_segments.begin(), formatted_segments.end());
+    }
+
+    /**
+     * Returns the segment responsible for a key: the one with the largest start key not greater than the
+     * key, or the first segment for keys smaller than every start key, which are inserted in its buffer.
+     */
+    typename tree_type::const_iterator route(const KeyType &key) const
+    {
+        auto it = buffered_fiting_tree.lower_bound(key);
+        return it != buffered_fiting_tree.end() ? it : std::prev(buffered_fiting_tree.end());
+    }
+
+    /**
+     * Searches a key in the segment it is routed to.
+     */
+    iterator find(typename tree_type::const_iterator it, const KeyType &key) const
+    {
+        // A key has at most one item, since inserting a deleted key revives its item
+        auto &segment = segments[it.data()];
+        auto segment_it = segment.lower_bound(key);
+        if (segment_it != segment.end() && segment_it->key() == key && !segment_it->deleted())
+            return iterator(this, it, segment_it);
+
+        return end();
+    }
+
+    /**
+     * Records a write to a segment, which is replayed on the new segments if the segment is being rebuilt
+     * and the item of the key was already copied.
+     */
+    void log_write(typename tree_type::iterator it, const KeyType &key)
+    {
+        if (pending && pending->copied && it.key() == pending->segment_key && !(pending->cursor < key))
+            pending->written.push_back(key);
+
+        for (auto &merge : background)
+            if (merge.segment_key == it.key())
+                merge.written.push_back(key);
+    }
+
+    /**
+     * Replaces a segment with the segments rebuilt from a copy of its items. The keys written after the
+     * copy are then set to their state in the old segment.
+     */
+    template <typename KeyVector>
+    void replace_segment(typename tree_type::iterator it, segment_vector &formatted_segments, const KeyVector &written)
+    {
+        // The index keeps at least one segment, as in compact
+        if (formatted_segments.empty() && buffered_fiting_tree.size() == 1)
+            return;
+
+        // The state of the written keys, with the deleted ones flagged
+        auto &segment = segments[it.data()];
+        std::vector<std::pair<pair_type, bool>, rebind_alloc<std::pair<pair_type, bool>>> writes(allocator);
+        for (auto &key : written)
+        {
+            auto item = segment.lower_bound(key);
+            bool present = item != segment.end() && item->key() == key && !item->deleted();
+            writes.emplace_back(pair_type(key, present ? item->pos() : PosType()), present);
+        }
 
-        auto in_fun = [this, first](auto i) { return pair_type(first[i], i); };
-        auto out_fun = [this](auto segment) { segments.emplace_back(segment); };
-        num_segments = get_all_segments_buffered(n, seg_error, buffer_size, in_fun, out_fun);
+        erase_segment(it);
+        insert_segments(formatted_segments.begin(), formatted_segments.end());
 
-        formatted_segments.reserve(num_segments);
-        for (auto it = segments.rbegin(); it != segments.rend(); ++it)
+        for (auto &[item, present] : writes)
         {
-            formatted_segments.emplace_back(it->get_start_key(), *it);
+            if (present)
+                insert_key(item.first, item.second, true);
+            else
+                erase_key(item.first);
         }
+    }
 
-        buffered_fiting_tree.bulk_load(formatted_segments.begin(), formatted_segments.end());
+    /**
+     * Replaces a segment rebuilt by the merge worker, unless it was rebuilt since its merge was submitted.
+     */
+    void apply_merge(merge_result_type &result)
+    {
+        auto merge = std::find_if(background.begin(), background.end(), [&result](auto &m) { return m.id == result.first; });
+        if (merge == background.end())
+            return;
+
+        auto written = std::move(merge->written);
+        auto it = buffered_fiting_tree.find(merge->segment_key);
+        background.erase(merge);
+        replace_segment(it, result.second, written);
     }
 
-    iterator find(const KeyType &key) const
+    /**
+     * Applies the merges done by the merge worker.
+     */
+    void apply_merges()
     {
-        if (n == 0)
-            return end();
+        if (merge_worker)
+            while (auto result = merge_worker->poll())
+                apply_merge(*result);
+    }
 
+    /**
+     * Starts rebuilding a segment whose buffer is nearly full, on the merge worker if there is one and
+     * otherwise incrementally if a merge step is set. A segment is rebuilt once at a time.
+     */
+    void start_merge(typename tree_type::iterator it)
+    {
+        if (merge_worker)
+        {
+            if (std::any_of(background.begin(), background.end(), [&it](auto &m) { return m.segment_key == it.key(); }))
+                return;
+
+            MergeJob job{next_job_id++, max_segment_size, pair_vector(allocator)};
+            segments[it.data()].append_live_items(job.items);
+            background.push_back({job.id, it.key(), std::vector<KeyType, rebind_alloc<KeyType>>(allocator)});
+            merge_worker->submit(std::move(job));
+        }
+        else if (merge_step > 0 && !pending)
+        {
+            pending.emplace(it.key(), max_segment_size, allocator);
+        }
+    }
+
+    /**
+     * Copies at most budget items of the segment being rebuilt to the new segments. Once every item is
+     * copied, the new segments replace the old one and the keys written meanwhile are set to their state
+     * in the old segment.
+     */
+    void advance_merge(size_t budget)
+    {
+        auto out_fun = [this](auto segment) { pending->formatted_segments.emplace_back(segment.get_start_key(), std::move(segment)); };
+
+        // The segment is searched again, since the iterators of the tree do not survive its modifications
+        auto it = buffered_fiting_tree.find(pending->segment_key);
+        auto &segment = segments[it.data()];
+        auto segment_it = segment.begin();
+        if (pending->copied)
+        {
+            segment_it = segment.lower_bound(pending->cursor);
+            if (segment_it != segment.end() && segment_it->key() == pending->cursor)
+                ++segment_it;
+        }
+
+        for (; budget > 0 && segment_it != segment.end(); ++segment_it, --budget)
+        {
+            if (!segment_it->deleted())
+                pending->segmenter.add(segment_it->key(), segment_it->pos(), out_fun);
+            pending->cursor = segment_it->key();
+            pending->copied = true;
+        }
+
+        if (segment_it != segment.end())
+            return;
+
+        pending->segmenter.finish(out_fun);
+
+        auto formatted_segments = std::move(pending->formatted_segments);
+        auto written = std::move(pending->written);
+        pending.reset();
+        replace_segment(it, formatted_segments, written);
+    }
+
+    /**
+     * Does the merge work due at the start of a write, see set_merge_step and set_background_merges.
+     */
+    void step_merges()
+    {
+        apply_merges();
+        if (pending)
+            advance_merge(merge_step);
+    }
+
+    /**
+     * Inserts a key in the segment it is routed to, which is searched once for the key and then updates
+     * it, revives it or inserts it. When the segment is full its items are absorbed, see absorb_buffer.
+     */
+    bool insert_key(const KeyType &key, const PosType &pos, bool assign)
+    {
         auto it = buffered_fiting_tree.lower_bound(key);
         if (it == buffered_fiting_tree.end())
-            return end();
+            --it; // The key precedes every segment and is inserted in the first one, see route
 
-        KeyType start_key = it->second.get_start_key();
-        auto [slope, intercept] = it->second.get_slope_intercept();
-        auto pos = (key - start_key) * slope;
-        auto lower_bound = SUB_ERR(pos, error_value);
-        auto upper_bound = ADD_ERR(pos, error_value, it.data().size());
+        auto &segment = segments[it.data()];
+        auto result = segment.insert(key, pos, assign);
+        if (result != InsertResult::full)
+        {
+            log_write(it, key);
+            if (result == InsertResult::inserted && segment.nearly_full())
+                start_merge(it);
+            return result == InsertResult::inserted;
+        }
 
-        auto lower_bound_it = it.data().begin();
-        auto upper_bound_it = it.data().begin();
-        for (; lower_bound > 0; --lower_bound)
-            ++lower_bound_it;
+        // A segment filled during its rebuild by the merge worker waits for it
+        auto is_segment = [segment_key = it.key()](auto &m) { return m.segment_key == segment_key; };
+        if (std::any_of(background.begin(), background.end(), is_segment))
+        {
+            while (std::any_of(background.begin(), background.end(), is_segment))
+            {
+                auto result = merge_worker->wait();
+                apply_merge(result);
+            }
+            return insert_key(key, pos, assign);
+        }
 
-        for (; upper_bound > 0; --upper_bound)
-            ++upper_bound_it;
+        // A segment filled during its rebuild finishes it at once
+        if (pending && it.key() == pending->segment_key)
+        {
+            advance_merge(std::numeric_limits<size_t>::max());
+            return insert_key(key, pos, assign);
+        }
 
-        auto segment_it = std::lower_bound(lower_bound_it, upper_bound_it, key);
-        if (segment_it != it.data().end() && segment_it->key() == key)
+        // The keys that no longer fit the model of the segment are segmented again
+        auto &rest = scratch_items;
+        rest.clear();
+        segment.absorb_buffer(key, pos, seg_error, max_segment_size, rest);
+        if (rest.empty())
+            return true;
+
+        // An empty segment is replaced by the first new one, in place unless the new key moved its start key
+        auto &formatted_segments = scratch_segments;
+        formatted_segments.clear();
+        make_segments(rest.size(), [&rest](auto i) { return rest[i]; }, max_segment_size, formatted_segments);
+        auto segment_it = formatted_segments.begin();
+        if (segment.size() == 0)
         {
-            return segment_it->deleted() ? end() : iterator(this, it, segment_it);
+            if (segment_it->first == it.key())
+            {
+                segment = std::move(segment_it->second);
+                ++segment_it;
+            }
+            else
+            {
+                erase_segment(it);
+            }
         }
 
-        return end();
+        insert_segments(segment_it, formatted_segments.end());
+        return true;
     }
 
-    iterator lower_bound(const KeyType &key)
+    /**
+     * Marks the item of a key as deleted in the segment it is routed to, see erase.
+     */
+    bool erase_key(const KeyType &key)
+    {
+        auto it = buffered_fiting_tree.lower_bound(key);
+        if (it == buffered_fiting_tree.end())
+            --it; // The key precedes every segment and is in the first one, see route
+
+        auto &segment = segments[it.data()];
+        if (!segment.erase(key))
+            return false;
+
+        log_write(it, key);
+        if (segment.deleted_count() > max_deleted_ratio * segment.size())
+            compact(it);
+        return true;
+    }
+
+public:
+    iterator find(const KeyType &key) const
     {
         if (n == 0)
             return end();
 
-        auto it = buffered_fiting_tree.lower_bound(key);
-        if (it == buffered_fiting_tree.end())
-            return begin();
+        return find(route(key), key);
+    }
+
+    /**
+     * Searches a batch of keys. The keys are routed in groups and the predicted position of every key in
+     * its segment is prefetched before any of the segments of the group is searched.
+     * @param first, last the range containing the keys to search for
+     * @param out the beginning of the range receiving an iterator to every key, or end() if it is missing
+     */
+    template <typename InputIt, typename OutputIt>
+    void find_batch(InputIt first, InputIt last, OutputIt out) const
+    {
+        KeyType group[batch_group_size];
+        typename tree_type::const_iterator its[batch_group_size];
+
+        while (first != last)
+        {
+            size_t count = 0;
+            for (; first != last && count < batch_group_size; ++first, ++count)
+                group[count] = *first;
 
-        KeyType start_key = it.data().get_start_key();
-        auto [slope, intercept] = it.data().get_slope_intercept();
-        auto pos = (key - start_key) * slope;
-        auto lower_bound = SUB_ERR(pos, error_value);
-        auto upper_bound = ADD_ERR(pos, error_value, it.data().size());
+            if (n == 0)
+            {
+                for (size_t j = 0; j < count; ++j, ++out)
+                    *out = end();
+                continue;
+            }
 
-        auto lower_bound_it = it.data().begin();
-        auto upper_bound_it = it.data().begin();
-        for (; lower_bound > 0; --lower_bound)
-            ++lower_bound_it;
+            for (size_t j = 0; j < count; ++j)
+            {
+                its[j] = route(group[j]);
+                segments[its[j].data()].prefetch(group[j]);
+            }
 
-        for (; upper_bound > 0; --upper_bound)
-            ++upper_bound_it;
+            for (size_t j = 0; j < count; ++j, ++out)
+                *out = find(its[j], group[j]);
+        }
+    }
 
-        auto segment_it = std::lower_bound(lower_bound_it, upper_bound_it, key);
-        if (segment_it == it.data().end())
+    iterator lower_bound(const KeyType &key)
+    {
+        if (n == 0)
+            return end();
+
+        auto it = route(key);
+        auto segment_it = segments[it.data()].lower_bound(key);
+        if (segment_it == segments[it.data()].end())
         {
-            --it;
-            if (it == buffered_fiting_tree.rend())
+            if (it == buffered_fiting_tree.begin())
                 return end();
-            segment_it = it.data().begin();
+            --it;
+            segment_it = segments[it.data()].begin();
         }
 
         while (segment_it->deleted())
         {
             ++segment_it;
-            if (segment_it == it.data().end())
+            if (segment_it == segments[it.data()].end())
             {
-                --it;
-                if (it == buffered_fiting_tree.rend())
+                if (it == buffered_fiting_tree.begin())
                     return end();
-                segment_it = it.data().begin();
+                --it;
+                segment_it = segments[it.data()].begin();
             }
         }
 
         return iterator(this, it, segment_it);
     }
 
-    void insert(const KeyType &key, const PosType &pos)
+    /**
+     * Inserts a key and its value if the key is missing or deleted.
+     * @param key the key to insert
+     * @param pos the value associated with the key
+     * @return true if the key was inserted, false if it was already present
+     */
+    bool insert(const KeyType &key, const PosType &pos)
     {
-        if (find(key) != end())
-            return;
+        if (n == 0)
+        {
+            insert_first(key, pos);
+            return true;
+        }
 
-        auto it = buffered_fiting_tree.lower_bound(key);
-        if (it == buffered_fiting_tree.end())
-            it = buffered_fiting_tree.rbegin();
+        step_merges();
+        return insert_key(key, pos, false);
+    }
 
-        if (!it.data().insert_buffer(key, pos))
+    /**
+     * Inserts a key and its value, or assigns the value to the key if it is already present.
+     * @param key the key to insert
+     * @param pos the value associated with the key
+     * @return true if the key was inserted, false if the value was assigned
+     */
+    bool insert_or_assign(const KeyType &key, const PosType &pos)
+    {
+        if (n == 0)
         {
-            std::vector<pair_type> merged_keys;
-            merged_keys = it.data().merge_buffer(key, pos);
-            auto merged_keys_it = merged_keys.begin();
-
-            std::vector<BufferedSegment<KeyType, PosType>> new_segments;
-            std::vector<tree_pair_type> formatted_segments;
-            auto in_fun = [this, merged_keys_it](auto i) { return pair_type(merged_keys_it[i].first, merged_keys_it[i].second); };
-            auto out_fun = [&new_segments](auto segment) { new_segments.emplace_back(segment); };
-
-            size_t num_segments = get_all_segments_buffered(merged_keys.size(), seg_error, buffer_size, in_fun, out_fun);
-            formatted_segments.reserve(num_segments);
-            for (auto it = new_segments.begin(); it != new_segments.end(); ++it)
-            {
-                formatted_segments.emplace_back(it->get_start_key(), *it);
-            }
+            insert_first(key, pos);
+            return true;
+        }
 
-            auto segment_it = formatted_segments.begin();
-            auto current_segment = it.data();
-            current_segment = segment_it->second;
+        step_merges();
+        return insert_key(key, pos, true);
+    }
 
-            ++segment_it;
-            buffered_fiting_tree.insert(segment_it, formatted_segments.end());
+    /**
+     * Inserts a key and its value, or updates the value of the key if it is already present, see
+     * insert_or_assign.
+     * @param key the key to insert or update
+     * @param pos the value associated with the key
+     */
+    void upsert(const KeyType &key, const PosType &pos)
+    {
+        insert_or_assign(key, pos);
+    }
+
+    /**
+     * Marks the item of a key as deleted. A segment whose deleted items exceed max_deleted_ratio of its
+     * items is rebuilt without them, so the cost of the compactions is amortized over the deletions.
+     * @param key the key to erase
+     * @return true if the key was present, false otherwise
+     */
+    bool erase(const KeyType &key)
+    {
+        if (n == 0)
+            return false;
+
+        step_merges();
+        return erase_key(key);
+    }
+
+    /**
+     * Selects how a segment is rebuilt when its buffer fills. With a step of 0, the default, the insert
+     * that fills the buffer rebuilds the whole segment. Otherwise the rebuild starts once the buffer is
+     * half full and every following insert or erase copies at most step items to the new segments, while
+     * the old segment and the free half of its buffer serve all the operations. A segment whose buffer
+     * fills before its rebuild ends finishes it at once, so the step should be at least the number of keys
+     * in a segment divided by half the buffer size. Only one segment is rebuilt at a time.
+     * @param step the maximum number of items copied by an operation, or 0 to rebuild segments at once
+     */
+    void set_merge_step(size_t step)
+    {
+        merge_step = step;
+        if (step == 0 && pending)
+            advance_merge(std::numeric_limits<size_t>::max());
+    }
+
+    /**
+     * Moves the rebuilds of the segments to a background thread, which takes precedence over the merge
+     * step. A segment whose buffer is half full is copied and handed to the thread, which segments the copy
+     * again while the old segment and the free half of its buffer serve all the operations. The new
+     * segments replace the old one at the first write after the rebuild is done, and the keys written
+     * meanwhile are replayed on them. A write that would start a rebuild beyond the capacity waits for
+     * one to be done, and so does an insert in a segment whose buffer fills during its rebuild. The thread
+     * allocates the new segments and frees the copies with the allocator of the index, which must then be
+     * thread-safe.
+     * @param capacity the maximum number of rebuilds waiting or running, or 0 to stop the thread
+     */
+    void set_background_merges(size_t capacity)
+    {
+        if (pending)
+            advance_merge(std::numeric_limits<size_t>::max());
+
+        while (!background.empty())
+        {
+            auto result = merge_worker->wait();
+            apply_merge(result);
         }
+
+        merge_worker.reset();
+        if (capacity > 0)
+            merge_worker = std::make_unique<merge_worker_type>(capacity, &run_merge_job);
     }
 
-    void erase(const KeyType &key)
+    /**
+     * Rebuilds all the segments from the items that are not deleted, which also merges the neighbouring
+     * segments whose keys fit a single model.
+     */
+    void compact()
     {
-        auto it = find(key);
-        if (it == end())
+        pending.reset();
+        background.clear();
+
+        pair_vector items(allocator);
+        for (auto it = buffered_fiting_tree.rbegin(); it != buffered_fiting_tree.rend(); ++it)
+            segments[it.data()].append_live_items(items);
+
+        if (items.empty())
             return;
 
-        it->set_deleted();
+        buffered_fiting_tree.clear();
+        segments.clear();
+        load_segments(items.size(), [&items](auto i) { return items[i]; });
+    }
+
+    /**
+     * Returns the number of segments in the index.
+     * @return the number of segments
+     */
+    size_t get_segments_count() const
+    {
+        return buffered_fiting_tree.size();
     }
 
     iterator begin() const
@@ -203,32 +850,29 @@ public:
         if (n == 0)
             return end();
 
-        return iterator(this, buffered_fiting_tree.rbegin(), buffered_fiting_tree.rbegin().data().begin());
+        return iterator(this, buffered_fiting_tree.rbegin(), segments[buffered_fiting_tree.rbegin().data()].begin());
     }
 
     iterator end() const
     {
-        return iterator(this, buffered_fiting_tree.rend(), buffered_fiting_tree.rbegin().data().end());
+        // An empty index has no segment to refer to
+        if (n == 0)
+            return iterator(this, buffered_fiting_tree.rend(), typename segment_type::iterator());
+
+        return iterator(this, buffered_fiting_tree.rend(), segments[buffered_fiting_tree.rbegin().data()].end());
     }
 };
 
-template <typename K, typename P, uint64_t Error, uint64_t BufferSize, typename Floating>
-class BufferedFitingTree<K, P, Error, BufferSize, Floating>::BufferedFitingTreeIterator
+template <typename K, typename P, uint64_t Error, uint64_t BufferSize, typename Floating, typename SegmentType, typename Segmentation>
+class BufferedFitingTree<K, P, Error, BufferSize, Floating, SegmentType, Segmentation>::BufferedFitingTreeIterator
 {
     friend class BufferedFitingTree;
 
     using pair_type = typename std::pair<K, P>;
-    using segment_iterator = typename BufferedSegment<K, P, Floating>::BufferedSegmentIterator;
-    using tree_iterator = typename stx::btree<K,
-                                              BufferedSegment<K, P>,
-                                              std::pair<K, BufferedSegment<K, P>>,
-                                              std::greater<K>,
-                                              stx::btree_default_map_traits<K, BufferedSegment<K, P>>,
-                                              false,
-                                              std::allocator<std::pair<K, BufferedSegment<K, P>>>,
-                                              false>::const_reverse_iterator;
-    using segment_type = BufferedSegment<K, P, Floating>;
-    using buffered_fiting_tree_type = BufferedFitingTree<K, P, Error, BufferSize, Floating>;
+    using segment_iterator = typename SegmentType::iterator;
+    using tree_iterator = typename BufferedFitingTree<K, P, Error, BufferSize, Floating, SegmentType, Segmentation>::tree_type::const_reverse_iterator;
+    using segment_type = SegmentType;
+    using buffered_fiting_tree_type = BufferedFitingTree<K, P, Error, BufferSize, Floating, SegmentType, Segmentation>;
 
     const buffered_fiting_tree_type *super;
     segment_iterator segment_it;
@@ -243,7 +887,7 @@ class BufferedFitingTree<K, P, Error, BufferSize, Floating>::BufferedFitingTreeI
         }
 
         ++segment_it;
-        if (segment_it == tree_it.data().end())
+        if (segment_it == super->segments[tree_it.data()].end())
         {
             ++tree_it;
             if (tree_it == super->buffered_fiting_tree.rend())
@@ -251,24 +895,25 @@ class BufferedFitingTree<K, P, Error, BufferSize, Floating>::BufferedFitingTreeI
                 *this = super->end();
                 return;
             }
-            segment_it = tree_it.data().begin();
+            segment_it = super->segments[tree_it.data()].begin();
         }
     }
 
-    BufferedFitingTreeIterator() = default;
-
     BufferedFitingTreeIterator(const buffered_fiting_tree_type *super, tree_iterator tree_it, segment_iterator segment_it)
-        : super(super), tree_it(tree_it), segment_it(segment_it){};
+        : super(super), segment_it(segment_it), tree_it(tree_it){};
 
-    BufferedFitingTreeIterator(const BufferedFitingTreeIterator &copy)
-        : super(copy.super), tree_it(copy.tree_it), segment_it(segment_it){};
+    // A reverse iterator constructed from an iterator refers to the previous slot, hence the step back
+    BufferedFitingTreeIterator(const buffered_fiting_tree_type *super, typename tree_type::const_iterator it, segment_iterator segment_it)
+        : BufferedFitingTreeIterator(super, --tree_iterator(it), segment_it){};
 
 public:
     using iterator_category = std::forward_iterator_tag;
-    using value_type = const typename BufferedSegment<K, P, Floating>::DataItem;
-    using difference_type = const size_t;
-    using pointer = const typename BufferedSegment<K, P, Floating>::DataItem *;
-    using reference = const typename BufferedSegment<K, P, Floating>::DataItem &;
+    using value_type = const typename SegmentType::DataItem;
+    using difference_type = std::ptrdiff_t;
+    using pointer = typename SegmentType::DataItemPointer;
+    using reference = typename SegmentType::DataItem;
+
+    BufferedFitingTreeIterator() = default;
 
     BufferedFitingTreeIterator &operator++()
     {
@@ -284,9 +929,9 @@ public:
     }
 
     reference operator*() const { return *segment_it; }
-    pointer operator->() const { return &(*segment_it); }
-    bool operator==(const BufferedFitingTreeIterator &rhs) { return ((segment_it == rhs.segment_it) && (tree_it == rhs.tree_it)); }
-    bool operator!=(const BufferedFitingTreeIterator &rhs) { return ((segment_it != rhs.segment_it) || (tree_it != rhs.tree_it)); }
+    pointer operator->() const { return segment_it.operator->(); }
+    bool operator==(const BufferedFitingTreeIterator &rhs) const { return ((segment_it == rhs.segment_it) && (tree_it == rhs.tree_it)); }
+    bool operator!=(const BufferedFitingTreeIterator &rhs) const { return ((segment_it != rhs.segment_it) || (tree_it != rhs.tree_it)); }
 };
 
 #endif
\ No newline at end of file
@@ -1,59 +1,335 @@
 #ifndef BUF_SEGMENT_H
 #define BUF_SEGMENT_H
 
+#include <limits>
+#include <memory>
 #include <vector>
-#include <map>
+#include <cstdint>
+#include <algorithm>
+
+#include "search.h"
+#include "fixed_point.h"
+
+/**
+ * A reference to a key stored in a segment, its value and its deletion flag, which the segments keep in
+ * separate arrays.
+ */
+template <typename KeyType, typename PosType>
+class SegmentItem
+{
+private:
+    const KeyType *first;
+    const PosType *second;
+    uint64_t *deleted_word;
+    uint64_t deleted_mask;
+
+public:
+    SegmentItem() = default;
+    SegmentItem(const KeyType *key, const PosType *pos, uint64_t *deleted_word, uint64_t deleted_mask)
+        : first(key), second(pos), deleted_word(deleted_word), deleted_mask(deleted_mask){};
+
+    bool deleted() const { return *deleted_word & deleted_mask; }
+    void set_deleted() const { *deleted_word |= deleted_mask; }
+
+    const KeyType &key() const { return *first; }
+    const PosType &pos() const { return *second; }
+
+    bool operator<(const KeyType &key) const { return *first < key; }
+};
+
+/**
+ * The outcome of inserting a key in a segment
+ */
+enum class InsertResult
+{
+    inserted, // The key was added, or a deleted item of the key was replaced
+    present,  // The key was already present, and its value was assigned if requested
+    full      // The segment has no room for the key, whose items must be absorbed, see absorb_buffer
+};
+
+/**
+ * The result of the arrow operator of the segment iterators, which holds the referenced SegmentItem.
+ */
+template <typename KeyType, typename PosType>
+struct SegmentItemPointer
+{
+    SegmentItem<KeyType, PosType> item;
+    const SegmentItem<KeyType, PosType> *operator->() const { return &item; }
+};
 
 /**
  * The BufferedSegment type represents a segment created during segmentation process of the data.
  * The segments are created using the Shrinking Cone Algorithm. It differs from the normal Segment
- * by providing a buffer for every segment to accomodate inserts effeciently.
+ * by providing a buffer for every segment to accomodate inserts effeciently. The buffer is a sorted
+ * array stored inline in the segment, so inserting in it never allocates.
  * 
  * @tparam KeyType - The type of the key to be indexed
  * @tparam PosType - The type of the positions (usually an unsigned integer type)
- * @tparam Floating - The type used to represent floating-point numbers for slope
+ * @tparam Floating - The type used to represent the slope, either a floating-point type or a FixedPoint
+ * @tparam BufferSize - The capacity of the buffer
+ * @tparam Allocator - The allocator of the stored keys, rebound for the values and the bitmap, e.g. a
+ *         std::pmr::polymorphic_allocator over a SizeClassPool
 */
-template <typename KeyType, typename PosType, typename Floating = long double>
+template <typename KeyType, typename PosType, typename Floating = long double, size_t BufferSize = 32, typename Allocator = std::allocator<KeyType>>
 class BufferedSegment
 {
 public:
     class BufferedSegmentIterator;
-    class DataItem;
 
+    using DataItem = SegmentItem<KeyType, PosType>;
+    using DataItemPointer = SegmentItemPointer<KeyType, PosType>;
     using iterator = BufferedSegmentIterator;
     using pair_type = std::pair<KeyType, PosType>;
+    using allocator_type = Allocator;
+
+    template <typename T>
+    using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
 
 private:
     KeyType start_key;          // The smallest key in the segment
     PosType start_pos;          // The position of the smallest key
     KeyType end_key;            // The largest key in the segment
     Floating slope;             // The slope of the segment
-    std::vector<DataItem> keys; // Stores all the key value pairs present in the segment
-    std::map<KeyType,
-             DataItem,
-             std::less<KeyType>>
-        buffer;               // A buffer maintained in sorted order for inserts
-    uint64_t buffer_size;     // Current Buffer size
-    uint64_t max_buffer_size; // Maximum Buffer size allowed
+    uint8_t max_below;          // The largest distance of a key below its predicted offset, saturated
+    uint8_t max_above;          // The largest distance of a key above its predicted offset, saturated
+    int16_t shift;              // The predicted offset of the smallest key, see ::predict_offset
+    static constexpr size_t buffer_words = (BufferSize + 63) / 64;
+
+    std::vector<KeyType, rebind_alloc<KeyType>> keys;              // The keys present in the segment
+    std::vector<PosType, rebind_alloc<PosType>> positions;         // The value of every key
+    mutable std::vector<uint64_t, rebind_alloc<uint64_t>> deleted; // A bitmap of the deleted keys
+    size_t num_deleted;                                            // The number of items deleted with erase
+    size_t buffer_size;                                            // Current Buffer size
+    KeyType buffer_keys[BufferSize];                               // A buffer maintained in sorted order for inserts
+    PosType buffer_positions[BufferSize];                          // The value of every key in the buffer
+    mutable uint64_t buffer_deleted[buffer_words];                 // A bitmap of the deleted keys in the buffer
+
+    void copy_buffer(const BufferedSegment &other)
+    {
+        std::copy_n(other.buffer_keys, buffer_size, buffer_keys);
+        std::copy_n(other.buffer_positions, buffer_size, buffer_positions);
+        std::copy_n(other.buffer_deleted, buffer_words, buffer_deleted);
+    }
+
+    /**
+     * Returns the index of the first key at or after i that is not deleted, skipping whole words of
+     * deleted keys at once.
+     */
+    static size_t next_live(const uint64_t *bitmap, size_t i, size_t size)
+    {
+        while (i < size)
+        {
+            uint64_t live = ~bitmap[i / 64] >> (i % 64);
+            if (live)
+                return std::min(i + __builtin_ctzll(live), size);
+            i = (i / 64 + 1) * 64;
+        }
+        return size;
+    }
+
+    DataItem stored_item(size_t i) const
+    {
+        return DataItem(&keys[i], &positions[i], &deleted[i / 64], 1ull << (i % 64));
+    }
+
+    DataItem buffer_item(size_t i) const
+    {
+        return DataItem(&buffer_keys[i], &buffer_positions[i], &buffer_deleted[i / 64], 1ull << (i % 64));
+    }
+
+    /**
+     * Returns the index of the first stored key not smaller than a key, searching the range given by the
+     * error bounds around the prediction.
+     */
+    size_t stored_lower_bound(const KeyType &key) const
+    {
+        size_t lo = 0;
+        size_t hi = keys.size();
+
+        if (max_below != unknown_error && max_above != unknown_error)
+        {
+            // Keys past the end of the segment saturate the prediction, which is clamped to the number of keys,
+            // and keys before its start, which can be buffered in the first segment, are predicted at zero
+            uint64_t pos = key < start_key ? 0 : std::min<uint64_t>(predict_offset(key), keys.size());
+            lo = pos <= max_below ? 0 : pos - max_below;
+            hi = std::min<uint64_t>(pos + max_above + 2, keys.size());
+        }
+
+        return BinarySearch::lower_bound(keys.data(), lo, hi, 0, key);
+    }
+
+    /**
+     * Updates the item of a key found by insert.
+     */
+    InsertResult update(PosType &value, uint64_t &deleted_word, uint64_t mask, const PosType &pos, bool assign)
+    {
+        if (deleted_word & mask)
+        {
+            deleted_word &= ~mask;
+            value = pos;
+            num_deleted -= num_deleted > 0;
+            return InsertResult::inserted;
+        }
+
+        if (assign)
+            value = pos;
+        return InsertResult::present;
+    }
+
+    /**
+     * Marks the item of a key found by erase as deleted.
+     */
+    bool mark_deleted(uint64_t &deleted_word, uint64_t mask)
+    {
+        if (deleted_word & mask)
+            return false;
+
+        deleted_word |= mask;
+        ++num_deleted;
+        return true;
+    }
+
+    /**
+     * Calls f with the key and the value of every item that is not deleted, in sorted order.
+     */
+    template <typename F>
+    void for_each_live(F f) const
+    {
+        size_t i = next_live(deleted.data(), 0, keys.size());
+        size_t j = next_live(buffer_deleted, 0, buffer_size);
+        while (i < keys.size() || j < buffer_size)
+        {
+            if (i == keys.size() || (j < buffer_size && buffer_keys[j] < keys[i]))
+            {
+                f(buffer_keys[j], buffer_positions[j]);
+                j = next_live(buffer_deleted, j + 1, buffer_size);
+            }
+            else
+            {
+                f(keys[i], positions[i]);
+                i = next_live(deleted.data(), i + 1, keys.size());
+            }
+        }
+    }
+
+    /**
+     * Checks whether the stored keys and the given sorted keys, once merged, fit the model within error. A
+     * stored key moves up by at most the number of added keys, and the position of an added key is found
+     * by searching the stored keys. The widened error bounds are returned in below and above.
+     */
+    bool fits_model(const KeyType *added_keys, size_t m, uint64_t error, uint64_t &below, uint64_t &above) const
+    {
+        if (max_below == unknown_error || max_above == unknown_error || max_above + m > error)
+            return false;
+
+        above = max_above + m;
+        for (size_t r = 0; r < m; ++r)
+        {
+            if (added_keys[r] < start_key)
+                return false;
+
+            uint64_t pos = std::lower_bound(keys.begin(), keys.end(), added_keys[r]) - keys.begin() + r;
+            uint64_t pred = predict_offset(added_keys[r]);
+            if (std::max(pred, pos) - std::min(pred, pos) > error)
+                return false;
+
+            below = std::max(below, pred > pos ? pred - pos : 0);
+            above = std::max(above, pos > pred ? pos - pred : 0);
+        }
+
+        return true;
+    }
+
+    /**
+     * Merges the given sorted items in the stored keys, from the back so that no stored key moves twice.
+     */
+    void merge_in_place(const KeyType *added_keys, const PosType *added_positions, size_t m)
+    {
+        size_t i = keys.size();
+        size_t k = keys.size() + m;
+        keys.resize(k);
+        positions.resize(k);
+        deleted.resize((k + 63) / 64);
+
+        for (size_t j = m; j > 0;)
+        {
+            --k;
+            bool stored = i > 0 && added_keys[j - 1] < keys[i - 1];
+            if (stored)
+                --i;
+            else
+                --j;
+
+            keys[k] = stored ? keys[i] : added_keys[j];
+            positions[k] = stored ? positions[i] : added_positions[j];
+            bool is_deleted = stored && (deleted[i / 64] >> (i % 64) & 1);
+            deleted[k / 64] = (deleted[k / 64] & ~(1ull << (k % 64))) | uint64_t(is_deleted) << (k % 64);
+        }
+
+        end_key = std::max(end_key, keys.back());
+        std::fill(buffer_deleted, buffer_deleted + buffer_words, 0);
+        buffer_size = 0;
+    }
 
 public:
+    /**
+     * The value of an error bound that was not recorded or does not fit in 8 bits
+     */
+    static constexpr uint8_t unknown_error = std::numeric_limits<uint8_t>::max();
+
     BufferedSegment() = default;
 
+    /**
+     * Copies a segment, storing its keys with another allocator, as done by the containers that pass
+     * their allocator to their elements
+     * @param other - The segment to copy
+     * @param alloc - The allocator of the stored keys
+     */
+    BufferedSegment(const BufferedSegment &other, const Allocator &alloc)
+        : start_key(other.start_key), start_pos(other.start_pos), end_key(other.end_key), slope(other.slope),
+          max_below(other.max_below), max_above(other.max_above), shift(other.shift), keys(other.keys, alloc), positions(other.positions, alloc),
+          deleted(other.deleted, alloc), num_deleted(other.num_deleted), buffer_size(other.buffer_size)
+    {
+        copy_buffer(other);
+    }
+
+    /**
+     * Moves a segment, storing its keys with another allocator, see above
+     * @param other - The segment to move
+     * @param alloc - The allocator of the stored keys
+     */
+    BufferedSegment(BufferedSegment &&other, const Allocator &alloc)
+        : start_key(other.start_key), start_pos(other.start_pos), end_key(other.end_key), slope(other.slope),
+          max_below(other.max_below), max_above(other.max_above), shift(other.shift), keys(std::move(other.keys), alloc),
+          positions(std::move(other.positions), alloc), deleted(std::move(other.deleted), alloc), num_deleted(other.num_deleted),
+          buffer_size(other.buffer_size)
+    {
+        copy_buffer(other);
+    }
+
     /**
      * Constructs a new segment
      * @param start_key - The smallest key in the segment
      * @param start_pos - The position of the smallest key
      * @param end_key - The largest key in the segment
      * @param slope - The slope of the segment
+     * @param shift - The predicted offset of the smallest key, see ::predict_offset
+     * @param p_keys - The (key, value) pairs stored in the segment, e.g. a vector or a PairRange
+     * @param alloc - The allocator of the stored keys
      */
-    BufferedSegment(KeyType start_key, PosType start_pos, KeyType end_key, Floating slope, std::vector<pair_type> p_keys, uint64_t max_buffer_size)
-        : start_key(start_key), start_pos(start_pos), end_key(end_key), slope(slope), buffer(), buffer_size(0), max_buffer_size(max_buffer_size)
+    template <typename PairVector>
+    BufferedSegment(KeyType start_key, PosType start_pos, KeyType end_key, Floating slope, int16_t shift, const PairVector &p_keys,
+                    const Allocator &alloc = Allocator())
+        : start_key(start_key), start_pos(start_pos), end_key(end_key), slope(slope), max_below(unknown_error), max_above(unknown_error),
+          shift(shift), keys(alloc), positions(alloc), deleted((p_keys.size() + 63) / 64, 0, alloc), num_deleted(0), buffer_size(0), buffer_deleted()
     {
         keys.reserve(p_keys.size());
+        positions.reserve(p_keys.size());
 
-        for (auto i = 0; i < p_keys.size(); i++)
+        for (const auto &p : p_keys)
         {
-            keys.emplace_back(p_keys[i].first, p_keys[i].second);
+            keys.push_back(p.first);
+            positions.push_back(p.second);
         }
     }
 
@@ -72,46 +348,235 @@ public:
      */
     std::pair<long double, long double> get_slope_intercept() const
     {
-        return {slope, start_pos};
+        return {static_cast<long double>(slope), start_pos};
     }
 
-    bool insert_buffer(const KeyType &key, const PosType &pos)
+    /**
+     * Returns the predicted offset of a key from the smallest key in the segment
+     * @param key - A key not smaller than the smallest key in the segment
+     * @return the predicted offset, rounded down
+     */
+    uint64_t predict_offset(const KeyType &key) const
     {
-        if (buffer_size >= max_buffer_size)
-            return false;
+        return ::predict_offset(slope, start_key, key, shift);
+    }
 
-        buffer.insert({key, DataItem(key, pos)});
+    /**
+     * Returns the predicted position of a key, rounded down
+     * @param key - A key not smaller than the smallest key in the segment
+     * @return the predicted position
+     */
+    uint64_t predict(const KeyType &key) const
+    {
+        return start_pos + predict_offset(key);
+    }
+
+    /**
+     * Returns the largest distances of the positions of the keys in the segment below and above their
+     * predictions when the segment was built, or unknown_error for a bound that was not recorded or is at
+     * least unknown_error
+     * @return a std::pair of [below, above]
+     */
+    std::pair<uint8_t, uint8_t> get_error_bounds() const
+    {
+        return {max_below, max_above};
+    }
+
+    /**
+     * Records the largest distances of the positions of the keys in the segment below and above their
+     * predictions, see fit_error_bounds
+     * @param below - The largest distance below the predictions
+     * @param above - The largest distance above the predictions
+     */
+    void set_error_bounds(uint64_t below, uint64_t above)
+    {
+        max_below = uint8_t(std::min<uint64_t>(below, unknown_error));
+        max_above = uint8_t(std::min<uint64_t>(above, unknown_error));
+    }
+
+    /**
+     * Prefetches the stored key predicted for the given key, so that a later search for it finds the
+     * search range in cache
+     * @param key - A key not smaller than the smallest key in the segment
+     */
+    void prefetch(const KeyType &key) const
+    {
+        if (!keys.empty())
+            __builtin_prefetch(keys.data() + std::min<uint64_t>(predict_offset(key), keys.size() - 1));
+    }
+
+    /**
+     * Inserts a key with a single search of the stored keys and of the buffer. A deleted item of the key
+     * is replaced in place, and a new key goes to the buffer.
+     * @param key - The key to insert
+     * @param pos - The value associated with the key
+     * @param assign - Whether to assign the value to an item of the key that is not deleted
+     * @return the outcome of the insert, full if the key is new and the buffer is full
+     */
+    InsertResult insert(const KeyType &key, const PosType &pos, bool assign)
+    {
+        size_t i = stored_lower_bound(key);
+        if (i < keys.size() && keys[i] == key)
+            return update(positions[i], deleted[i / 64], 1ull << (i % 64), pos, assign);
+
+        size_t j = LinearSearch::lower_bound(buffer_keys, 0, buffer_size, 0, key);
+        if (j < buffer_size && buffer_keys[j] == key)
+            return update(buffer_positions[j], buffer_deleted[j / 64], 1ull << (j % 64), pos, assign);
+
+        if (buffer_size >= BufferSize)
+            return InsertResult::full;
+
+        std::copy_backward(buffer_keys + j, buffer_keys + buffer_size, buffer_keys + buffer_size + 1);
+        std::copy_backward(buffer_positions + j, buffer_positions + buffer_size, buffer_positions + buffer_size + 1);
+
+        // The flags from j onwards move up by one bit, carrying across words
+        for (size_t w = buffer_words - 1; w > j / 64; --w)
+            buffer_deleted[w] = buffer_deleted[w] << 1 | buffer_deleted[w - 1] >> 63;
+        uint64_t low = (1ull << (j % 64)) - 1;
+        buffer_deleted[j / 64] = (buffer_deleted[j / 64] & low) | (buffer_deleted[j / 64] & ~low) << 1;
+
+        buffer_keys[j] = key;
+        buffer_positions[j] = pos;
         buffer_size += 1;
-        return true;
+        return InsertResult::inserted;
+    }
+
+    /**
+     * Marks the item of a key as deleted
+     * @param key - The key to erase
+     * @return true if the key was present and not deleted, false otherwise
+     */
+    bool erase(const KeyType &key)
+    {
+        size_t i = stored_lower_bound(key);
+        if (i < keys.size() && keys[i] == key)
+            return mark_deleted(deleted[i / 64], 1ull << (i % 64));
+
+        size_t j = LinearSearch::lower_bound(buffer_keys, 0, buffer_size, 0, key);
+        if (j < buffer_size && buffer_keys[j] == key)
+            return mark_deleted(buffer_deleted[j / 64], 1ull << (j % 64));
+
+        return false;
     }
 
-    std::vector<pair_type> merge_buffer(const KeyType &new_key, const PosType &new_pos) const
+    /**
+     * Appends the items of the segment that are not deleted together with a new item to a vector, in sorted
+     * order
+     * @param new_key - The key of the new item
+     * @param new_pos - The value of the new item
+     * @param merged_keys - The vector receiving the (key, value) pairs
+     */
+    template <typename PairVector>
+    void merge_buffer(const KeyType &new_key, const PosType &new_pos, PairVector &merged_keys) const
     {
-        std::vector<pair_type> merged_keys;
-        merged_keys.reserve(keys.size() + buffer_size + 1);
+        merged_keys.reserve(merged_keys.size() + keys.size() + buffer_size + 1);
         bool new_key_added = false;
 
-        auto it = begin();
-        while (it != end())
-        {
-            if (it->deleted())
+        for_each_live([&](const KeyType &key, const PosType &pos) {
+            if (!new_key_added && new_key < key)
             {
-                ++it;
-                continue;
+                merged_keys.emplace_back(new_key, new_pos);
+                new_key_added = true;
             }
+            merged_keys.emplace_back(key, pos);
+        });
+
+        if (!new_key_added)
+            merged_keys.emplace_back(new_key, new_pos);
+    }
 
-            if (!new_key_added && new_key < it->key())
+    /**
+     * Appends the items of the segment that are not deleted to a vector, in sorted order
+     * @param out - The vector receiving the (key, value) pairs
+     */
+    template <typename PairVector>
+    void append_live_items(PairVector &out) const
+    {
+        for_each_live([&](const KeyType &key, const PosType &pos) { out.emplace_back(key, pos); });
+    }
+
+    /**
+     * Merges the buffer and a new item in the stored keys without segmenting them again. When the recorded
+     * error bounds, widened by the shift of the stored keys, and the buffered keys fit the model within the
+     * given error, the buffer is merged in place in O(buffer) checks. Otherwise the keys are merged and the
+     * longest prefix that fits the model stays in the segment, while the remaining keys are removed from it.
+     * The segment never grows beyond max_size keys.
+     * @param new_key - The key of the new item, not in the segment
+     * @param new_pos - The value of the new item
+     * @param error - The maximum error allowed for the model
+     * @param max_size - The maximum number of keys stored in the segment
+     * @param rest - The empty vector receiving the sorted items removed from the segment, to be segmented
+     *        again, which are all of them if the segment is left empty
+     */
+    template <typename PairVector>
+    void absorb_buffer(const KeyType &new_key, const PosType &new_pos, uint64_t error, size_t max_size, PairVector &rest)
+    {
+        // The live buffered keys and the new one, in sorted order
+        KeyType added_keys[BufferSize + 1];
+        PosType added_positions[BufferSize + 1];
+        size_t m = 0;
+        bool new_key_added = false;
+        for (size_t j = next_live(buffer_deleted, 0, buffer_size); j < buffer_size; j = next_live(buffer_deleted, j + 1, buffer_size))
+        {
+            if (!new_key_added && new_key < buffer_keys[j])
             {
-                merged_keys.emplace_back(new_key, new_pos);
+                added_keys[m] = new_key;
+                added_positions[m++] = new_pos;
                 new_key_added = true;
-                continue;
             }
+            added_keys[m] = buffer_keys[j];
+            added_positions[m++] = buffer_positions[j];
+        }
+        if (!new_key_added)
+        {
+            added_keys[m] = new_key;
+            added_positions[m++] = new_pos;
+        }
 
-            merged_keys.emplace_back(it->key(), it->pos());
-            ++it;
+        uint64_t below = max_below;
+        uint64_t above = max_above;
+        if (keys.size() + m <= max_size && fits_model(added_keys, m, error, below, above))
+        {
+            // The deleted buffered items are dropped
+            num_deleted -= std::min<size_t>(num_deleted, buffer_size + 1 - m);
+            merge_in_place(added_keys, added_positions, m);
+            set_error_bounds(below, above);
+            return;
         }
 
-        return merged_keys;
+        auto &merged_keys = rest;
+        merge_buffer(new_key, new_pos, merged_keys);
+
+        // Keys before the start of the segment change its start key and cannot be kept
+        size_t t = 0;
+        below = 0;
+        above = 0;
+        for (; t < std::min(merged_keys.size(), max_size) && !(merged_keys[t].first < start_key); ++t)
+        {
+            uint64_t pred = predict_offset(merged_keys[t].first);
+            if (std::max(pred, t) - std::min(pred, t) > error)
+                break;
+            below = std::max(below, pred > t ? pred - t : 0);
+            above = std::max(above, t > pred ? t - pred : 0);
+        }
+
+        keys.clear();
+        positions.clear();
+        for (size_t i = 0; i < t; ++i)
+        {
+            keys.push_back(merged_keys[i].first);
+            positions.push_back(merged_keys[i].second);
+        }
+        deleted.assign((t + 63) / 64, 0);
+        std::fill(buffer_deleted, buffer_deleted + buffer_words, 0);
+        buffer_size = 0;
+        num_deleted = 0;
+
+        if (t > 0)
+            end_key = keys.back();
+        set_error_bounds(below, above);
+
+        merged_keys.erase(merged_keys.begin(), merged_keys.begin() + t);
     }
 
     size_t size() const
@@ -119,35 +584,46 @@ public:
         return (keys.size() + buffer_size);
     }
 
-    iterator begin() const
+    /**
+     * Returns whether the buffer is at least half full, so that the segment should be rebuilt soon
+     * @return true if the segment is nearly full
+     */
+    bool nearly_full() const
     {
-        if (keys.empty())
-            return end();
-
-        auto key_it = keys.begin();
-        for (auto it = keys.begin(); it != keys.end(); ++it)
-        {
-            if (it->deleted())
-                continue;
-            key_it = it;
-            break;
-        }
+        return 2 * buffer_size >= BufferSize;
+    }
 
-        auto buffer_it = buffer.begin();
-        for (auto it = buffer.begin(); it != buffer.end(); ++it)
-        {
-            if (it->second.deleted())
-                continue;
-            buffer_it = it;
-            break;
-        }
+    /**
+     * Returns the number of items deleted with erase that are still stored in the segment
+     * @return the number of deleted items
+     */
+    size_t deleted_count() const
+    {
+        return num_deleted;
+    }
 
-        return iterator(this, key_it, buffer_it);
+    iterator begin() const
+    {
+        size_t i = next_live(deleted.data(), 0, keys.size());
+        size_t j = next_live(buffer_deleted, 0, buffer_size);
+        return iterator(this, i == keys.size() ? 0 : i, j == buffer_size ? 0 : j);
     }
 
     iterator end() const
     {
-        return iterator(this, keys.end(), buffer.end());
+        return iterator(this, keys.size(), buffer_size);
+    }
+
+    /**
+     * Returns an iterator to the first item not smaller than a key. The stored keys are binary searched
+     * by index in the range given by the error bounds around the prediction, and the buffer is searched
+     * separately.
+     * @param key - The key to search for
+     * @return an iterator to the first item not smaller than key, possibly deleted
+     */
+    iterator lower_bound(const KeyType &key) const
+    {
+        return iterator(this, stored_lower_bound(key), LinearSearch::lower_bound(buffer_keys, 0, buffer_size, 0, key));
     }
 
     inline bool operator<(const BufferedSegment &s)
@@ -161,128 +637,65 @@ public:
     }
 };
 
-template <typename K, typename P, typename Floating>
-class BufferedSegment<K, P, Floating>::BufferedSegmentIterator
+template <typename K, typename P, typename Floating, size_t BufferSize, typename Allocator>
+class BufferedSegment<K, P, Floating, BufferSize, Allocator>::BufferedSegmentIterator
 {
     friend class BufferedSegment;
 
-    using item_type = typename BufferedSegment<K, P, Floating>::DataItem;
-    using keys_iterator = typename std::vector<item_type>::const_iterator;
-    using buffer_iterator = typename std::map<K, item_type>::const_iterator;
-    using buffered_segment_type = BufferedSegment<K, P, Floating>;
+    using item_type = typename BufferedSegment<K, P, Floating, BufferSize, Allocator>::DataItem;
+    using buffered_segment_type = BufferedSegment<K, P, Floating, BufferSize, Allocator>;
 
     const buffered_segment_type *super;
-    keys_iterator key_it;
-    buffer_iterator buffer_it;
+    size_t key_i;    // The index of the current stored key
+    size_t buffer_i; // The index of the current buffered key
 
-    void advance_iterator()
+    bool buffer_first() const
     {
-        if (key_it == super->keys.end() && buffer_it == super->buffer.end())
-        {
-            *this = super->end();
-            return;
-        }
-        else if (key_it == super->keys.end())
-        {
-            ++buffer_it;
-            return;
-        }
-        else if (buffer_it == super->buffer.end())
-        {
-            ++key_it;
-            return;
-        }
-        else
-        {
-            if (key_it->key() > buffer_it->first)
-            {
-                ++buffer_it;
-                return;
-            }
-            ++key_it;
-        }
+        if (buffer_i == super->buffer_size)
+            return false;
+        return key_i == super->keys.size() || super->keys[key_i] > super->buffer_keys[buffer_i];
     }
 
 public:
     using iterator_category = std::forward_iterator_tag;
-    using value_type = const DataItem;
-    using difference_type = size_t;
-    using pointer = const DataItem *;
-    using reference = const DataItem &;
+    using value_type = const item_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = typename buffered_segment_type::DataItemPointer;
+    using reference = item_type;
 
     BufferedSegmentIterator() = default;
 
-    BufferedSegmentIterator(const buffered_segment_type *super, keys_iterator key_it, buffer_iterator buffer_it)
-        : super(super), key_it(key_it), buffer_it(buffer_it){};
-
-    BufferedSegmentIterator(const BufferedSegmentIterator &copy)
-        : super(copy.super), key_it(copy.key_it), buffer_it(copy.buffer_it){};
+    BufferedSegmentIterator(const buffered_segment_type *super, size_t key_i, size_t buffer_i)
+        : super(super), key_i(key_i), buffer_i(buffer_i){};
 
     BufferedSegmentIterator &operator++()
     {
-        advance_iterator();
+        if (buffer_first())
+            ++buffer_i;
+        else if (key_i < super->keys.size())
+            ++key_i;
         return *this;
     }
 
     BufferedSegmentIterator operator++(int)
     {
         BufferedSegmentIterator i(*this);
-        advance_iterator();
+        ++*this;
         return i;
     }
 
     reference operator*() const
     {
-        if (key_it == super->keys.end() && buffer_it == super->buffer.end())
-        {
-            return *super->end();
-        }
-        else if (key_it == super->keys.end())
-        {
-            return buffer_it->second;
-        }
-        else if (buffer_it == super->buffer.end())
-        {
-            return *key_it;
-        }
-        else
-        {
-            if (key_it->key() > buffer_it->first)
-            {
-                return buffer_it->second;
-            }
-            return *key_it;
-        }
+        return buffer_first() ? super->buffer_item(buffer_i) : super->stored_item(key_i);
     }
 
     pointer operator->() const
     {
-        return &(**this);
+        return {**this};
     }
 
-    bool operator==(const BufferedSegmentIterator &rhs) const { return ((key_it == rhs.key_it) && (buffer_it == rhs.buffer_it)); }
-    bool operator!=(const BufferedSegmentIterator &rhs) const { return ((key_it != rhs.key_it) || (buffer_it != rhs.buffer_it)); }
-};
-
-template <typename K, typename P, typename Floating>
-class BufferedSegment<K, P, Floating>::DataItem
-{
-private:
-    K first;
-    P second;
-    bool is_deleted;
-
-public:
-    DataItem() = default;
-    explicit DataItem(const K &key, const P &pos) : first(key), second(pos), is_deleted(false){};
-
-    bool deleted() const { return is_deleted; }
-    void set_deleted() { is_deleted = true; }
-
-    const K &key() const { return first; }
-    const P &pos() const { return second; }
-
-    bool operator<(const K &key) const { return first < key; }
+    bool operator==(const BufferedSegmentIterator &rhs) const { return ((key_i == rhs.key_i) && (buffer_i == rhs.buffer_i)); }
+    bool operator!=(const BufferedSegmentIterator &rhs) const { return ((key_i != rhs.key_i) || (buffer_i != rhs.buffer_i)); }
 };
 
 #endif
\ No newline at end of file
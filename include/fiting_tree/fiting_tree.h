@@ -3,11 +3,17 @@
 
 #include <cstddef>
 #include <cassert>
+#include <limits>
 #include <vector>
+#include <algorithm>
+#include <stdexcept>
 
+#include "search.h"
 #include "segment.h"
+#include "btree_router.h"
+#include "flat_router.h"
+#include "learned_router.h"
 #include "piecewise_linear_model.h"
-#include "stx/btree.h"
 
 #define ADD_ERR(x, error, size) ((x) + (error) >= (size) ? (size) : (x) + (error))
 #define SUB_ERR(x, error) ((x) <= (error) ? 0 : ((x) - (error)))
@@ -17,9 +23,9 @@
  * the size of an index. 
  * 
  * The index is built on a sorted sequence of keys. A query returns a struct ApproxPos containing
- * the approximate position of the key and the bounds of the range of size 2*Error where the key to be
- * found exists, if present. In the case of repeated keys, the index finds the position of the first 
- * occurrence.
+ * the approximate position of the key and the bounds of the range of size at most 2*Error where the key
+ * to be found exists, if present. The range is narrowed to the largest deviations measured in every
+ * segment. In the case of repeated keys, the index finds the position of the first occurrence.
  * 
  * The @p Error template parameter should be set according to the desired space-time trade-off. A 
  * smaller error value makes the estimation more precise and the range smaller but at the cost of 
@@ -27,14 +33,23 @@
  * 
  * @tparam KeyType - The type of the indexed elements
  * @tparam Error - The maximum error allowed in the segmentation process
- * @tparam Floating - The floating-point type to use for storing slopes
+ * @tparam Floating - The type used to store slopes, a floating-point type or a FixedPoint (see DefaultSlope)
+ * @tparam PosType - The unsigned integer type used to store positions in the segments
+ * @tparam Router - The structure mapping a key to its segment, a BTreeRouter, FlatRouter or LearnedRouter
+ * @tparam Segmentation - The segmentation policy, ShrinkingCone or OptimalPLA (fewer segments, slower build)
 */
-template <typename KeyType, uint64_t Error = 64, typename Floating = long double>
+template <typename KeyType,
+          uint64_t Error = 64,
+          typename Floating = DefaultSlope<KeyType>,
+          typename PosType = uint64_t,
+          typename Router = BTreeRouter<KeyType>,
+          typename Segmentation = ShrinkingCone>
 class FitingTree
 {
     static_assert(Error > 0);
+    static_assert(std::is_unsigned_v<PosType>);
 
-private:
+public:
     /**
      * A struct that stores the result of a query to a @ref FITing-Tree, that is, a range [@ref lo, @ref hi)
      * centered around an approximate position @ref pos of the sought key.
@@ -46,18 +61,38 @@ private:
         uint64_t lo;  // The upper bound of the range where the key can be found
     };
 
-    size_t n;                                         // Total number of keys
-    KeyType first_key;                                // The smallest key
-    std::vector<Segment<KeyType, uint64_t>> segments; // The segments composing the index
-    stx::btree<KeyType,
-               Segment<KeyType, uint64_t>,
-               std::pair<KeyType, Segment<KeyType, uint64_t>>,
-               std::greater<KeyType>,
-               stx::btree_default_map_traits<KeyType, Segment<KeyType, uint64_t>>,
-               false,
-               std::allocator<std::pair<KeyType, Segment<KeyType, uint64_t>>>,
-               false>
-        fiting_tree; // STX B+ Tree containing all the segments
+private:
+    using segment_type = Segment<KeyType, PosType, Floating>;
+
+    static constexpr size_t batch_group_size = 32; // The number of lookups interleaved by the batched queries
+
+    size_t n;                           // Total number of keys
+    KeyType first_key;                  // The smallest key
+    std::vector<segment_type> segments; // The segments composing the index, the only copy of them
+    Router router;                      // Maps a key to the position of its segment in segments
+
+    /**
+     * Returns the approximate position of a key given the index of the segment responsible for it.
+     */
+    ApproxPos get_approx_pos(size_t i, const KeyType &key) const
+    {
+        // The rounded prediction is within one position of the exact one
+        uint64_t pos = segments[i].predict(key);
+
+        // A key between the last key of a segment and the next segment is ranked at the start of the next
+        // segment, and a key past the last one at n, while the extrapolated prediction can be arbitrarily
+        // far from them
+        pos = std::min<uint64_t>(pos, i + 1 < segments.size() ? segments[i + 1].get_start_pos() : n - 1);
+
+        // The bounds recorded at build time are usually much tighter than the error of the segmentation
+        auto [below, above] = segments[i].get_error_bounds();
+        uint64_t max_below = below == segment_type::unknown_error ? Error + 1 : below;
+        uint64_t max_above = above == segment_type::unknown_error ? Error + 1 : above;
+
+        uint64_t hi = ADD_ERR(pos, max_above + 2, n);
+        uint64_t lo = SUB_ERR(pos, max_below);
+        return {pos, hi, lo};
+    }
 
 public:
     /**
@@ -68,44 +103,54 @@ public:
     /**
      * Constructs the index on the given sorted data.
      * @param data the vector of keys, must be sorted
+     * @param num_threads the number of threads used for the segmentation, 0 means one per hardware thread
      */
-    explicit FitingTree(const std::vector<KeyType> &data) : FitingTree(data.begin(), data.end()) {}
+    explicit FitingTree(const std::vector<KeyType> &data, size_t num_threads = 1)
+        : FitingTree(data.begin(), data.end(), num_threads) {}
 
     /**
      * Constructs the index on the sorted data in the range [first, last).
      * @param first, last the range containing the sorted elements to be indexed
+     * @param num_threads the number of threads used for the segmentation, 0 means one per hardware thread
      */
     template <typename RandomIt>
-    FitingTree(RandomIt first, RandomIt last)
-        : n(std::distance(first, last)), first_key(*first), segments(), fiting_tree()
+    FitingTree(RandomIt first, RandomIt last, size_t num_threads = 1)
+        : n(std::distance(first, last)), first_key(*first), segments(), router()
     {
         assert(std::is_sorted(first, last));
 
         if (n == 0)
             return;
 
-        using pair_type = typename std::pair<KeyType, uint64_t>;
-        using tree_pair_type = typename std::pair<KeyType, Segment<KeyType, uint64_t>>;
+        if (n - 1 > std::numeric_limits<PosType>::max())
+            throw std::length_error("the number of keys exceeds the range of PosType");
 
-        std::vector<tree_pair_type> formatted_segments;
+        using pair_type = typename std::pair<KeyType, PosType>;
+
+        std::vector<KeyType> start_keys;
         auto error_value = Error;
         size_t num_segments;
 
         auto in_fun = [this, first](auto i) { return pair_type(first[i], i); };
         auto out_fun = [this](auto segment) { segments.emplace_back(segment); };
-        num_segments = get_all_segments(n, error_value, in_fun, out_fun);
+        num_segments = get_all_segments_parallel<Floating, Segmentation>(n, error_value, num_threads, in_fun, out_fun);
+        segments.shrink_to_fit();
 
-        formatted_segments.reserve(num_segments);
-        for (auto it = segments.rbegin(); it != segments.rend(); ++it)
+        start_keys.reserve(num_segments);
+        for (auto &segment : segments)
         {
-            formatted_segments.emplace_back(it->get_start_key(), *it);
+            start_keys.push_back(segment.get_start_key());
         }
 
-        fiting_tree.bulk_load(formatted_segments.begin(), formatted_segments.end());
+        router = Router(start_keys.begin(), start_keys.end());
     }
 
     /**
-     * Returns the approximate position of a key.
+     * Returns the approximate position of a key. The position of the first element not smaller than key is
+     * in [lo, hi], also for a key that is not indexed, unless the bound above of its segment was too large
+     * to be recorded. The range then spans Error + 1 positions on each side of pos, which holds the first
+     * occurrence of every key, but a key that is not indexed can rank past hi after a long run of repeated
+     * keys (lower_bound continues the search in that case).
      * @param key the value of the element to search for
      * @return a struct with the approximate position
      */
@@ -114,23 +159,136 @@ public:
         if (n == 0)
             return {0, 0, 0};
 
-        auto it = fiting_tree.lower_bound(key);
-        if (it == fiting_tree.end())
+        if (key < first_key)
+            return {0, ADD_ERR(0, Error, n), 0};
+
+        return get_approx_pos(router.find(key), key);
+    }
+
+    /**
+     * Returns the first element not smaller than a key in the indexed data, searching the range returned
+     * by get_approx_pos with the given last-mile search kernel. The segments model the first occurrence of
+     * every key, so the answer for a key that is not indexed can lie past the range, after a run of repeated
+     * keys. The search then continues from the end of the range.
+     * @tparam Search the search kernel, see search.h
+     * @param data the beginning of the contiguous range the index was built on
+     * @param key the value of the element to search for
+     * @return an iterator to the first element not smaller than key, or data + n if there is none
+     */
+    template <typename Search = DefaultSearch<KeyType, Error>, typename RandomIt>
+    RandomIt lower_bound(RandomIt data, const KeyType &key) const
+    {
+        if (n == 0)
+            return data;
+
+        auto range = get_approx_pos(key);
+        size_t pos = Search::lower_bound(&*data, range.lo, range.hi, range.pos, key);
+        if (pos == range.hi && pos < n && data[pos] < key)
+            pos = ExponentialSearch::lower_bound(&*data, pos, n, pos, key);
+        return data + pos;
+    }
+
+    /**
+     * Returns an element equal to a key in the indexed data, see lower_bound.
+     * @tparam Search the search kernel, see search.h
+     * @param data the beginning of the contiguous range the index was built on
+     * @param key the value of the element to search for
+     * @return an iterator to the first element equal to key, or data + n if there is none
+     */
+    template <typename Search = DefaultSearch<KeyType, Error>, typename RandomIt>
+    RandomIt find(RandomIt data, const KeyType &key) const
+    {
+        auto it = lower_bound<Search>(data, key);
+        return it != data + n && *it == key ? it : data + n;
+    }
+
+    /**
+     * Returns the approximate positions of a batch of keys. The lookups are processed in groups whose
+     * routing steps are interleaved, so that the memory accesses of different keys overlap, and the
+     * segments of a group are prefetched before their models are evaluated.
+     * @param first, last the range containing the keys to search for
+     * @param out the beginning of the range receiving the approximate positions, in the same order
+     */
+    template <typename InputIt, typename OutputIt>
+    void get_approx_pos_batch(InputIt first, InputIt last, OutputIt out) const
+    {
+        KeyType group[batch_group_size];
+        size_t ids[batch_group_size];
+
+        while (first != last)
         {
-            return {0, Error, 0};
+            size_t count = 0;
+            for (; first != last && count < batch_group_size; ++first, ++count)
+                group[count] = *first;
+
+            if (n == 0)
+            {
+                for (size_t j = 0; j < count; ++j, ++out)
+                    *out = ApproxPos{0, 0, 0};
+                continue;
+            }
+
+            // Keys smaller than the first key are routed to the first segment and answered below
+            KeyType routed[batch_group_size];
+            for (size_t j = 0; j < count; ++j)
+                routed[j] = group[j] < first_key ? first_key : group[j];
+
+            router.find_batch(routed, count, ids);
+
+            for (size_t j = 0; j < count; ++j)
+                __builtin_prefetch(&segments[ids[j]]);
+
+            for (size_t j = 0; j < count; ++j, ++out)
+            {
+                if (group[j] < first_key)
+                    *out = ApproxPos{0, ADD_ERR(0, Error, n), 0};
+                else
+                    *out = get_approx_pos(ids[j], group[j]);
+            }
         }
-        else
+    }
+
+    /**
+     * Returns the approximate positions of a sorted batch of keys, e.g. the probes of a join. Only the first
+     * key is routed from the root: every other key starts from the segment of the previous key and gallops
+     * forward over the segments, so the cost is linear in the number of keys plus the segments touched.
+     * @param first, last the range containing the keys to search for, must be sorted
+     * @param out the beginning of the range receiving the approximate positions, in the same order
+     */
+    template <typename InputIt, typename OutputIt>
+    void get_approx_pos_sorted(InputIt first, InputIt last, OutputIt out) const
+    {
+        auto segment_less = [](const KeyType &k, const segment_type &s) { return k < s.get_start_key(); };
+
+        // Keys smaller than the first key precede all the others
+        for (; first != last && (n == 0 || *first < first_key); ++first, ++out)
+            *out = n == 0 ? ApproxPos{0, 0, 0} : ApproxPos{0, ADD_ERR(0, Error, n), 0};
+
+        if (first == last)
+            return;
+
+        size_t i = router.find(*first);
+        for (; first != last; ++first, ++out)
         {
-            KeyType start_key = it.data().get_start_key();
-            auto [slope, intercept] = it.data().get_slope_intercept();
-            auto pos = (key - start_key) * slope + intercept;
+            KeyType key = *first;
+            assert(!(key < segments[i].get_start_key()));
+
+            if (i + 1 < segments.size() && !(key < segments[i + 1].get_start_key()))
+            {
+                // Double the step until a segment starting after the key is found, then search the last gap
+                size_t lo = i + 1;
+                size_t step = 1;
+                while (lo + step < segments.size() && !(key < segments[lo + step].get_start_key()))
+                {
+                    lo += step;
+                    step *= 2;
+                }
 
-            if (pos - Error > n)
-                return {n - 1, n, n - 1};
+                size_t hi = std::min(lo + step, segments.size());
+                i = std::upper_bound(segments.begin() + lo + 1, segments.begin() + hi, key, segment_less) - segments.begin() - 1;
+            }
 
-            uint64_t hi = ADD_ERR(pos, Error, n);
-            uint64_t lo = SUB_ERR(pos, Error);
-            return {(uint64_t)pos, hi, lo};
+            *out = get_approx_pos(i, key);
         }
     }
 
@@ -0,0 +1,172 @@
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+
+/**
+ * The FixedPoint type represents a non-negative slope as mantissa / 2^shift. A prediction then costs an
+ * integer multiply and a shift instead of floating-point arithmetic, so lookups never touch the x87 unit.
+ *
+ * The mantissa is normalized so that its most significant bit is set, which makes the truncation error
+ * of a scaled delta smaller than the scaled value divided by 2^(digits - 1).
+ *
+ * @tparam Mantissa - The unsigned integer type of the mantissa
+ */
+template <typename Mantissa>
+struct FixedPoint
+{
+    static_assert(std::is_unsigned_v<Mantissa>);
+
+    static constexpr int digits = std::numeric_limits<Mantissa>::digits;
+
+    Mantissa mantissa; // The significant bits of the slope
+    uint8_t shift;     // The number of fractional bits of the mantissa
+
+    FixedPoint() = default;
+
+    /**
+     * Converts a slope to fixed-point, rounding it towards zero
+     * @param slope - The slope to convert, must be non-negative
+     */
+    explicit FixedPoint(long double slope) : mantissa(0), shift(0)
+    {
+        if (!(slope > 0))
+            return;
+
+        int exp;
+        std::frexp(slope, &exp);
+        int s = std::clamp(digits - exp, 0, 127);
+        long double scaled = std::ldexp(slope, s);
+        if (scaled >= std::ldexp(1.0L, digits))
+            scaled = std::ldexp(1.0L, digits) - 1;
+
+        mantissa = Mantissa(scaled);
+        shift = uint8_t(s);
+    }
+
+    /**
+     * Multiplies an unsigned delta by the slope
+     * @param delta - The value to scale
+     * @return the integral part of delta * slope, saturated to 64 bits
+     */
+    template <typename T>
+    uint64_t scale(T delta) const
+    {
+        static_assert(std::is_unsigned_v<T>);
+        using wide_type = std::conditional_t<(sizeof(T) + sizeof(Mantissa) <= 8), uint64_t, unsigned __int128>;
+
+        if constexpr (std::is_same_v<wide_type, uint64_t>)
+            return shift >= 64 ? 0 : (wide_type(delta) * mantissa) >> shift;
+        else
+        {
+            wide_type offset = (wide_type(delta) * mantissa) >> shift;
+            return offset > std::numeric_limits<uint64_t>::max() ? std::numeric_limits<uint64_t>::max() : uint64_t(offset);
+        }
+    }
+
+    explicit operator long double() const
+    {
+        return std::ldexp((long double)mantissa, -int(shift));
+    }
+};
+
+template <typename T>
+struct is_fixed_point : std::false_type
+{
+};
+
+template <typename Mantissa>
+struct is_fixed_point<FixedPoint<Mantissa>> : std::true_type
+{
+};
+
+template <typename T>
+inline constexpr bool is_fixed_point_v = is_fixed_point<T>::value;
+
+/**
+ * The slope representation used by default for a key type: fixed-point for integral keys, with a 32-bit
+ * mantissa when the key deltas fit in 32 bits so that the product fits in a 64-bit register, and double
+ * for floating-point keys.
+ */
+template <typename KeyType>
+using DefaultSlope = std::conditional_t<std::is_integral_v<KeyType>,
+                                        FixedPoint<std::conditional_t<(sizeof(KeyType) <= 4), uint32_t, uint64_t>>,
+                                        double>;
+
+/**
+ * Returns the largest number of positions a segment can span while the predictions computed with the given
+ * key and slope types stay within one position of the exact ones.
+ *
+ * @tparam KeyType - The type of the keys
+ * @tparam Floating - The slope representation
+ */
+template <typename KeyType, typename Floating>
+constexpr uint64_t max_segment_span()
+{
+    int digits = 64;
+    if constexpr (is_fixed_point_v<Floating>)
+        digits = Floating::digits;
+    else
+        digits = std::numeric_limits<Floating>::digits;
+
+    if constexpr (std::is_floating_point_v<KeyType>)
+        digits = std::min(digits, std::numeric_limits<KeyType>::digits);
+
+    return 1ull << std::min(digits - 2, 62);
+}
+
+/**
+ * The type of the difference between two keys: the unsigned counterpart of integral keys, so that the
+ * difference cannot overflow, and the key type itself otherwise.
+ */
+template <typename KeyType, bool = std::is_integral_v<KeyType>>
+struct key_delta
+{
+    using type = KeyType;
+};
+
+template <typename KeyType>
+struct key_delta<KeyType, true>
+{
+    using type = std::make_unsigned_t<KeyType>;
+};
+
+/**
+ * Returns the predicted offset of a key from the smallest key of a segment, rounded down and saturated to
+ * 64 bits. The result is within one position of the exact offset as long as the segment spans at most
+ * max_segment_span<KeyType, Floating>() positions.
+ *
+ * @param slope - The slope of the segment
+ * @param start_key - The smallest key in the segment
+ * @param key - A key not smaller than start_key
+ * @param shift - The predicted offset of start_key, nonzero when the model of the segment does not pass
+ *                through its first key. The offset of a key never goes below zero, where the key actually is
+ * @return the predicted offset
+ */
+template <typename KeyType, typename Floating>
+inline uint64_t predict_offset(const Floating &slope, const KeyType &start_key, const KeyType &key, int16_t shift = 0)
+{
+    using delta_type = typename key_delta<KeyType>::type;
+    delta_type delta = delta_type(key) - delta_type(start_key);
+
+    uint64_t offset;
+    if constexpr (is_fixed_point_v<Floating>)
+    {
+        offset = slope.scale(delta);
+    }
+    else
+    {
+        Floating exact = Floating(delta) * slope;
+        offset = exact < Floating(std::numeric_limits<uint64_t>::max()) ? uint64_t(exact) : std::numeric_limits<uint64_t>::max();
+    }
+
+    if (shift < 0)
+        return offset - std::min<uint64_t>(offset, uint64_t(-int64_t(shift)));
+    return std::min<uint64_t>(offset, std::numeric_limits<uint64_t>::max() - shift) + shift;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef FLAT_ROUTER_H
+#define FLAT_ROUTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * The FlatRouter type maps a key to the segment responsible for it using a static B+ tree laid out in a
+ * single array (S+ tree). Every node is a cache line of start keys and the children of a node are found by
+ * index arithmetic, so a lookup touches exactly one cache line per level and follows no pointers. The last
+ * layer holds all the start keys in sorted order, hence the position reached in it is the index of the
+ * segment in the parallel array of segments kept by the index.
+ *
+ * Nodes are compared with AVX2 instructions when available.
+ *
+ * @tparam KeyType - The type of the indexed keys
+ */
+template <typename KeyType>
+class FlatRouter
+{
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t B = cache_line_size / sizeof(KeyType); // The number of keys in a node
+
+    static_assert(B > 1 && cache_line_size % sizeof(KeyType) == 0);
+
+    struct alignas(cache_line_size) Node
+    {
+        KeyType keys[B];
+    };
+
+    size_t n = 0;                // The number of start keys
+    KeyType last_key;            // The largest start key
+    std::vector<Node> nodes;     // The layers of the tree, from the leaves to the root
+    std::vector<size_t> offsets; // The index of the first node of every layer
+
+    /**
+     * Returns the number of keys in a node not greater than the given key.
+     */
+    static size_t rank(const Node &node, const KeyType &key)
+    {
+#if defined(__AVX2__)
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 8)
+        {
+            // Flipping the sign bit makes the signed comparison order unsigned keys
+            const __m256i flip = _mm256_set1_epi64x(std::is_signed_v<KeyType> ? 0 : std::numeric_limits<int64_t>::min());
+            const __m256i x = _mm256_xor_si256(_mm256_set1_epi64x(int64_t(key)), flip);
+            size_t greater = 0;
+            for (size_t i = 0; i < B; i += 4)
+            {
+                __m256i v = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(node.keys + i)), flip);
+                greater += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, x))));
+            }
+            return B - greater;
+        }
+
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 4)
+        {
+            const __m256i flip = _mm256_set1_epi32(std::is_signed_v<KeyType> ? 0 : std::numeric_limits<int32_t>::min());
+            const __m256i x = _mm256_xor_si256(_mm256_set1_epi32(int32_t(key)), flip);
+            size_t greater = 0;
+            for (size_t i = 0; i < B; i += 8)
+            {
+                __m256i v = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(node.keys + i)), flip);
+                greater += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, x))));
+            }
+            return B - greater;
+        }
+
+        if constexpr (std::is_same_v<KeyType, double>)
+        {
+            const __m256d x = _mm256_set1_pd(key);
+            size_t greater = 0;
+            for (size_t i = 0; i < B; i += 4)
+                greater += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(node.keys + i), x, _CMP_GT_OQ)));
+            return B - greater;
+        }
+
+        if constexpr (std::is_same_v<KeyType, float>)
+        {
+            const __m256 x = _mm256_set1_ps(key);
+            size_t greater = 0;
+            for (size_t i = 0; i < B; i += 8)
+                greater += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_load_ps(node.keys + i), x, _CMP_GT_OQ)));
+            return B - greater;
+        }
+#endif
+
+        size_t not_greater = 0;
+        for (size_t i = 0; i < B; ++i)
+            not_greater += node.keys[i] <= key;
+        return not_greater;
+    }
+
+public:
+    FlatRouter() = default;
+
+    /**
+     * Constructs the router on the start keys of the segments.
+     * @param first, last the range containing the start keys, must be sorted and unique
+     */
+    template <typename RandomIt>
+    FlatRouter(RandomIt first, RandomIt last) : n(std::distance(first, last)), nodes(), offsets()
+    {
+        if (n == 0)
+            return;
+
+        last_key = first[n - 1];
+
+        // Missing keys are padded with the largest value, which is never descended into since lookups of
+        // keys not smaller than the last start key are answered directly
+        auto key_at = [&](size_t i) { return i < n ? KeyType(first[i]) : std::numeric_limits<KeyType>::max(); };
+
+        std::vector<size_t> layer_sizes{(n + B - 1) / B};
+        while (layer_sizes.back() > 1)
+            layer_sizes.push_back((layer_sizes.back() + B) / (B + 1));
+
+        size_t total = 0;
+        for (auto size : layer_sizes)
+        {
+            offsets.push_back(total);
+            total += size;
+        }
+        nodes.resize(total);
+
+        for (size_t k = 0; k < layer_sizes[0]; ++k)
+            for (size_t i = 0; i < B; ++i)
+                nodes[k].keys[i] = key_at(k * B + i);
+
+        // The i-th key of an inner node is the smallest key in the subtree of its (i + 1)-th child
+        size_t leaves_per_child = 1;
+        for (size_t h = 1; h < layer_sizes.size(); ++h)
+        {
+            for (size_t k = 0; k < layer_sizes[h]; ++k)
+            {
+                for (size_t i = 0; i < B; ++i)
+                {
+                    size_t child = k * (B + 1) + i + 1;
+                    size_t leaf = child * leaves_per_child;
+                    nodes[offsets[h] + k].keys[i] = leaf < layer_sizes[0] ? key_at(leaf * B) : std::numeric_limits<KeyType>::max();
+                }
+            }
+            leaves_per_child *= B + 1;
+        }
+    }
+
+    /**
+     * Returns the index of the segment with the largest start key not greater than the given key.
+     * @param key a key not smaller than the first start key
+     * @return the index of the segment
+     */
+    size_t find(const KeyType &key) const
+    {
+        if (!(key < last_key))
+            return n - 1;
+
+        size_t k = 0;
+        for (size_t h = offsets.size() - 1; h > 0; --h)
+            k = k * (B + 1) + rank(nodes[offsets[h] + k], key);
+
+        return k * B + rank(nodes[k], key) - 1;
+    }
+
+    /**
+     * Finds the segments of a batch of keys. The lookups descend the tree together, one layer at a time,
+     * and the node every lookup visits in the next layer is prefetched while the other lookups proceed.
+     * @param queries the keys, each not smaller than the first start key
+     * @param count the number of keys
+     * @param out the array receiving the indices of the segments
+     */
+    void find_batch(const KeyType *queries, size_t count, size_t *out) const
+    {
+        std::fill(out, out + count, 0);
+
+        for (size_t h = offsets.size() - 1; h > 0; --h)
+        {
+            for (size_t j = 0; j < count; ++j)
+            {
+                if (!(queries[j] < last_key))
+                    continue;
+
+                out[j] = out[j] * (B + 1) + rank(nodes[offsets[h] + out[j]], queries[j]);
+                __builtin_prefetch(&nodes[offsets[h - 1] + out[j]]);
+            }
+        }
+
+        for (size_t j = 0; j < count; ++j)
+            out[j] = queries[j] < last_key ? out[j] * B + rank(nodes[out[j]], queries[j]) - 1 : n - 1;
+    }
+};
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef GAPPED_SEGMENT_H
+#define GAPPED_SEGMENT_H
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "search.h"
+#include "fixed_point.h"
+#include "buffered_segment.h"
+
+/**
+ * The GappedSegment type is an alternative to the BufferedSegment that stores its keys in a gapped array,
+ * as in ALEX. Every key is placed at the slot predicted by the model of the segment, scaled to a capacity
+ * larger than the number of keys, so that the free slots are spread among the keys. An insert shifts the
+ * keys between its slot and the nearest free slot, which is usually a few slots away, and never retrains
+ * the model. When the density of the array exceeds max_density the insert fails, and the index merges the
+ * keys and segments them again, which expands the array back to initial_density.
+ *
+ * Every free slot holds the key of the next occupied slot, or the largest key value if there is none, so
+ * that the array is sorted and is searched directly.
+ *
+ * @tparam KeyType - The type of the key to be indexed
+ * @tparam PosType - The type of the positions (usually an unsigned integer type)
+ * @tparam Floating - The type used to represent the slope, either a floating-point type or a FixedPoint
+ * @tparam Allocator - The allocator of the slots, rebound for the values and the bitmaps, see BufferedSegment
+*/
+template <typename KeyType, typename PosType, typename Floating = long double, typename Allocator = std::allocator<KeyType>>
+class GappedSegment
+{
+public:
+    class GappedSegmentIterator;
+
+    using DataItem = SegmentItem<KeyType, PosType>;
+    using DataItemPointer = SegmentItemPointer<KeyType, PosType>;
+    using iterator = GappedSegmentIterator;
+    using pair_type = std::pair<KeyType, PosType>;
+    using allocator_type = Allocator;
+
+    template <typename T>
+    using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    static constexpr double initial_density = 0.7; // The fraction of occupied slots after a segmentation
+    static constexpr double max_density = 0.8;     // The fraction of occupied slots above which inserts fail
+
+private:
+    using bitmap_type = std::vector<uint64_t, rebind_alloc<uint64_t>>;
+
+    KeyType start_key;                                     // The smallest key in the segment
+    PosType start_pos;                                     // The position of the smallest key
+    KeyType end_key;                                       // The largest key in the segment
+    Floating slope;                                        // The slope of the segment, scaled to the slots
+    size_t num_keys;                                       // The number of occupied slots
+    size_t num_deleted;                                    // The number of items deleted with erase
+    int16_t shift;                                         // The predicted slot of the smallest key, see ::predict_offset
+    std::vector<KeyType, rebind_alloc<KeyType>> keys;      // The slots, free ones hold the key of the next occupied slot
+    std::vector<PosType, rebind_alloc<PosType>> positions; // The value of every occupied slot
+    bitmap_type occupied;                                  // A bitmap of the occupied slots
+    mutable bitmap_type deleted;                           // A bitmap of the deleted keys
+
+    static bool test_bit(const bitmap_type &bitmap, size_t i)
+    {
+        return bitmap[i / 64] >> (i % 64) & 1;
+    }
+
+    static void assign_bit(bitmap_type &bitmap, size_t i, bool value)
+    {
+        bitmap[i / 64] = (bitmap[i / 64] & ~(1ull << (i % 64))) | uint64_t(value) << (i % 64);
+    }
+
+    /**
+     * Returns the index of the first slot at or after i whose bit equals the given one, or the capacity.
+     */
+    size_t next_slot(const bitmap_type &bitmap, size_t i, bool bit) const
+    {
+        while (i < keys.size())
+        {
+            uint64_t match = (bit ? bitmap[i / 64] : ~bitmap[i / 64]) >> (i % 64);
+            if (match)
+                return std::min(i + __builtin_ctzll(match), keys.size());
+            i = (i / 64 + 1) * 64;
+        }
+        return keys.size();
+    }
+
+    /**
+     * Returns the index of the last free slot before i, or the capacity if there is none.
+     */
+    size_t prev_free_slot(size_t i) const
+    {
+        while (i > 0)
+        {
+            --i;
+            uint64_t free = ~occupied[i / 64] << (63 - i % 64);
+            if (free)
+                return i - __builtin_clzll(free);
+            i -= i % 64;
+        }
+        return keys.size();
+    }
+
+    /**
+     * Returns the slot predicted for a key, not larger than the last slot.
+     */
+    size_t predict_slot(const KeyType &key) const
+    {
+        if (key < start_key)
+            return 0;
+        return std::min<uint64_t>(::predict_offset(slope, start_key, key, shift), keys.size() - 1);
+    }
+
+    void place(size_t i, const KeyType &key, const PosType &pos)
+    {
+        keys[i] = key;
+        positions[i] = pos;
+        assign_bit(occupied, i, true);
+        assign_bit(deleted, i, false);
+    }
+
+    DataItem item(size_t i) const
+    {
+        return DataItem(&keys[i], &positions[i], &deleted[i / 64], 1ull << (i % 64));
+    }
+
+public:
+    GappedSegment() = default;
+
+    /**
+     * Copies a segment, storing its slots with another allocator, as done by the containers that pass
+     * their allocator to their elements
+     * @param other - The segment to copy
+     * @param alloc - The allocator of the slots
+     */
+    GappedSegment(const GappedSegment &other, const Allocator &alloc)
+        : start_key(other.start_key), start_pos(other.start_pos), end_key(other.end_key), slope(other.slope),
+          num_keys(other.num_keys), num_deleted(other.num_deleted), shift(other.shift), keys(other.keys, alloc), positions(other.positions, alloc),
+          occupied(other.occupied, alloc), deleted(other.deleted, alloc) {}
+
+    /**
+     * Moves a segment, storing its slots with another allocator, see above
+     * @param other - The segment to move
+     * @param alloc - The allocator of the slots
+     */
+    GappedSegment(GappedSegment &&other, const Allocator &alloc)
+        : start_key(other.start_key), start_pos(other.start_pos), end_key(other.end_key), slope(other.slope),
+          num_keys(other.num_keys), num_deleted(other.num_deleted), shift(other.shift), keys(std::move(other.keys), alloc),
+          positions(std::move(other.positions), alloc), occupied(std::move(other.occupied), alloc),
+          deleted(std::move(other.deleted), alloc) {}
+
+    /**
+     * Constructs a new segment
+     * @param start_key - The smallest key in the segment
+     * @param start_pos - The position of the smallest key
+     * @param end_key - The largest key in the segment
+     * @param slope - The slope of the segment over the positions of the keys
+     * @param shift - The predicted offset of the smallest key, see ::predict_offset
+     * @param p_keys - The sorted keys of the segment and their values, e.g. a vector or a PairRange
+     * @param alloc - The allocator of the slots
+     */
+    template <typename PairVector>
+    GappedSegment(KeyType start_key, PosType start_pos, KeyType end_key, Floating slope, int16_t shift, const PairVector &p_keys,
+                  const Allocator &alloc = Allocator())
+        : start_key(start_key), start_pos(start_pos), end_key(end_key), slope(), num_keys(p_keys.size()), num_deleted(0), shift(),
+          keys(alloc), positions(alloc), occupied(alloc), deleted(alloc)
+    {
+        size_t n = p_keys.size();
+        size_t capacity = std::max(size_t(n / initial_density), n + 1);
+        long double scale = (long double)capacity / std::max<size_t>(n, 1);
+        this->slope = Floating(static_cast<long double>(slope) * scale);
+        this->shift = int16_t(std::clamp<long double>(std::round(shift * scale), std::numeric_limits<int16_t>::min(),
+                                                      std::numeric_limits<int16_t>::max()));
+
+        keys.resize(capacity);
+        positions.resize(capacity);
+        occupied.resize((capacity + 63) / 64);
+        deleted.resize((capacity + 63) / 64);
+
+        // Every key goes to its predicted slot, or the first slot after the previous key, leaving enough
+        // slots for the following keys
+        size_t next = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const auto &p = p_keys[i];
+            size_t slot = std::clamp(predict_slot(p.first), next, capacity - (n - i));
+            place(slot, p.first, p.second);
+            next = slot + 1;
+        }
+
+        KeyType next_key = std::numeric_limits<KeyType>::max();
+        for (size_t i = capacity; i-- > 0;)
+        {
+            if (test_bit(occupied, i))
+                next_key = keys[i];
+            else
+                keys[i] = next_key;
+        }
+    }
+
+    /**
+     * Returns the smallest key in the segment
+     * @return the smallest key
+     */
+    KeyType get_start_key() const
+    {
+        return start_key;
+    }
+
+    /**
+     * Returns the slope over the slots and the intercept of the segment
+     * @return a std::pair of [slope, intercept]
+     */
+    std::pair<long double, long double> get_slope_intercept() const
+    {
+        return {static_cast<long double>(slope), start_pos};
+    }
+
+    /**
+     * Prefetches the slot predicted for the given key, so that a later search for it finds the search
+     * range in cache
+     * @param key - A key not smaller than the smallest key in the segment
+     */
+    void prefetch(const KeyType &key) const
+    {
+        __builtin_prefetch(keys.data() + predict_slot(key));
+    }
+
+    /**
+     * Inserts a key in a free slot, shifting the keys between its slot and the nearest free slot, or
+     * replaces a deleted item of the same key
+     * @param key - The key to insert
+     * @param pos - The value associated with the key
+     * @param assign - Whether to assign the value to an item of the key that is not deleted
+     * @return the outcome of the insert, full if the key is new and the segment is too dense
+     */
+    InsertResult insert(const KeyType &key, const PosType &pos, bool assign)
+    {
+        size_t i = ExponentialSearch::lower_bound(keys.data(), 0, keys.size(), predict_slot(key), key);
+        size_t j = next_slot(occupied, i, true);
+        if (j < keys.size() && keys[j] == key)
+        {
+            bool revived = test_bit(deleted, j);
+            if (revived || assign)
+                positions[j] = pos;
+            assign_bit(deleted, j, false);
+            num_deleted -= revived && num_deleted > 0;
+            return revived ? InsertResult::inserted : InsertResult::present;
+        }
+
+        if (num_keys + 1 > max_density * keys.size())
+            return InsertResult::full;
+
+        // The slots in [i, j) are free, and the free slots before the key now hold it
+        if (i < j)
+        {
+            size_t slot = std::clamp(predict_slot(key), i, j - 1);
+            place(slot, key, pos);
+            std::fill(keys.begin() + i, keys.begin() + slot, key);
+            ++num_keys;
+            return InsertResult::inserted;
+        }
+
+        // Otherwise the key goes before the occupied slot j, and the keys on the side of the nearest free
+        // slot move towards it
+        size_t right = next_slot(occupied, j, false);
+        size_t left = prev_free_slot(j);
+        if (left == keys.size() || (right < keys.size() && right - j < j - left))
+        {
+            std::copy_backward(keys.begin() + j, keys.begin() + right, keys.begin() + right + 1);
+            std::copy_backward(positions.begin() + j, positions.begin() + right, positions.begin() + right + 1);
+            for (size_t k = right; k > j; --k)
+                assign_bit(deleted, k, test_bit(deleted, k - 1));
+            assign_bit(occupied, right, true);
+            place(j, key, pos);
+        }
+        else
+        {
+            std::copy(keys.begin() + left + 1, keys.begin() + j, keys.begin() + left);
+            std::copy(positions.begin() + left + 1, positions.begin() + j, positions.begin() + left);
+            for (size_t k = left; k + 1 < j; ++k)
+                assign_bit(deleted, k, test_bit(deleted, k + 1));
+            assign_bit(occupied, left, true);
+            place(j - 1, key, pos);
+        }
+
+        ++num_keys;
+        return InsertResult::inserted;
+    }
+
+    /**
+     * Marks the item of a key as deleted
+     * @param key - The key to erase
+     * @return true if the key was present and not deleted, false otherwise
+     */
+    bool erase(const KeyType &key)
+    {
+        size_t i = ExponentialSearch::lower_bound(keys.data(), 0, keys.size(), predict_slot(key), key);
+        size_t j = next_slot(occupied, i, true);
+        if (j == keys.size() || keys[j] != key || test_bit(deleted, j))
+            return false;
+
+        assign_bit(deleted, j, true);
+        ++num_deleted;
+        return true;
+    }
+
+    /**
+     * Appends the items of the segment that are not deleted together with a new item to a vector, in sorted
+     * order
+     * @param new_key - The key of the new item
+     * @param new_pos - The value of the new item
+     * @param merged_keys - The vector receiving the (key, value) pairs
+     */
+    template <typename PairVector>
+    void merge_buffer(const KeyType &new_key, const PosType &new_pos, PairVector &merged_keys) const
+    {
+        merged_keys.reserve(merged_keys.size() + num_keys + 1);
+        bool new_key_added = false;
+
+        for (size_t i = next_slot(occupied, 0, true); i < keys.size(); i = next_slot(occupied, i + 1, true))
+        {
+            if (test_bit(deleted, i))
+                continue;
+
+            if (!new_key_added && new_key < keys[i])
+            {
+                merged_keys.emplace_back(new_key, new_pos);
+                new_key_added = true;
+            }
+            merged_keys.emplace_back(keys[i], positions[i]);
+        }
+
+        if (!new_key_added)
+            merged_keys.emplace_back(new_key, new_pos);
+    }
+
+    /**
+     * Appends the items of the segment that are not deleted to a vector, in sorted order
+     * @param out - The vector receiving the (key, value) pairs
+     */
+    template <typename PairVector>
+    void append_live_items(PairVector &out) const
+    {
+        for (size_t i = next_slot(occupied, 0, true); i < keys.size(); i = next_slot(occupied, i + 1, true))
+            if (!test_bit(deleted, i))
+                out.emplace_back(keys[i], positions[i]);
+    }
+
+    /**
+     * Removes all the items from the segment, since a gapped array is expanded by segmenting its keys
+     * again, see BufferedSegment::absorb_buffer
+     * @param new_key - The key of the new item, not in the segment
+     * @param new_pos - The value of the new item
+     * @param rest - The empty vector receiving the sorted items that are not deleted together with the new item
+     */
+    template <typename PairVector>
+    void absorb_buffer(const KeyType &new_key, const PosType &new_pos, uint64_t, size_t, PairVector &rest)
+    {
+        merge_buffer(new_key, new_pos, rest);
+        num_keys = 0;
+        num_deleted = 0;
+        keys.clear();
+        positions.clear();
+        occupied.clear();
+        deleted.clear();
+    }
+
+    size_t size() const
+    {
+        return num_keys;
+    }
+
+    /**
+     * Returns whether the density is past the midpoint of initial_density and max_density, so that the
+     * segment should be rebuilt soon
+     * @return true if the segment is nearly full
+     */
+    bool nearly_full() const
+    {
+        return num_keys >= (initial_density + max_density) / 2 * keys.size();
+    }
+
+    /**
+     * Returns the number of items deleted with erase that are still stored in the segment
+     * @return the number of deleted items
+     */
+    size_t deleted_count() const
+    {
+        return num_deleted;
+    }
+
+    /**
+     * Returns the number of slots in the segment
+     * @return the capacity
+     */
+    size_t capacity() const
+    {
+        return keys.size();
+    }
+
+    iterator begin() const
+    {
+        return iterator(this, next_slot(occupied, 0, true));
+    }
+
+    iterator end() const
+    {
+        return iterator(this, keys.size());
+    }
+
+    /**
+     * Returns an iterator to the first item not smaller than a key. The slots are searched exponentially
+     * outwards from the predicted slot.
+     * @param key - The key to search for
+     * @return an iterator to the first item not smaller than key, possibly deleted
+     */
+    iterator lower_bound(const KeyType &key) const
+    {
+        size_t i = ExponentialSearch::lower_bound(keys.data(), 0, keys.size(), predict_slot(key), key);
+        return iterator(this, next_slot(occupied, i, true));
+    }
+
+    inline bool operator<(const GappedSegment &s)
+    {
+        return start_key < s.start_key;
+    }
+
+    inline bool operator<(const KeyType &k)
+    {
+        return start_key < k;
+    }
+};
+
+template <typename K, typename P, typename Floating, typename Allocator>
+class GappedSegment<K, P, Floating, Allocator>::GappedSegmentIterator
+{
+    friend class GappedSegment;
+
+    using item_type = typename GappedSegment<K, P, Floating, Allocator>::DataItem;
+    using gapped_segment_type = GappedSegment<K, P, Floating, Allocator>;
+
+    const gapped_segment_type *super;
+    size_t slot; // The index of the current occupied slot
+
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = const item_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = typename gapped_segment_type::DataItemPointer;
+    using reference = item_type;
+
+    GappedSegmentIterator() = default;
+
+    GappedSegmentIterator(const gapped_segment_type *super, size_t slot) : super(super), slot(slot){};
+
+    GappedSegmentIterator &operator++()
+    {
+        slot = super->next_slot(super->occupied, slot + 1, true);
+        return *this;
+    }
+
+    GappedSegmentIterator operator++(int)
+    {
+        GappedSegmentIterator i(*this);
+        ++*this;
+        return i;
+    }
+
+    reference operator*() const
+    {
+        return super->item(slot);
+    }
+
+    pointer operator->() const
+    {
+        return {**this};
+    }
+
+    bool operator==(const GappedSegmentIterator &rhs) const { return slot == rhs.slot; }
+    bool operator!=(const GappedSegmentIterator &rhs) const { return slot != rhs.slot; }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef LEARNED_ROUTER_H
+#define LEARNED_ROUTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "segment.h"
+#include "fixed_point.h"
+#include "piecewise_linear_model.h"
+
+/**
+ * The LearnedRouter type maps a key to the segment responsible for it using recursive levels of
+ * error-bounded segments. The start keys of the segments are segmented with the shrinking cone algorithm,
+ * the start keys of the resulting segments are segmented again, and so on until the top level fits in a
+ * cache line. A lookup searches the top level and then, for every level, evaluates one segment and searches
+ * a window of 2 * (Error + 2) entries around its prediction.
+ *
+ * @tparam KeyType - The type of the indexed keys
+ * @tparam Error - The maximum error allowed in the segmentation of every level
+ * @tparam Floating - The type used to store the slopes of the routing segments
+ */
+template <typename KeyType, uint64_t Error = 16, typename Floating = DefaultSlope<KeyType>>
+class LearnedRouter
+{
+    static_assert(Error > 0);
+
+    using segment_id = uint32_t;
+    using segment_type = Segment<KeyType, segment_id, Floating>;
+
+    static constexpr size_t cache_line_size = 64;
+
+    std::vector<KeyType> keys;                      // The start keys of the indexed segments
+    std::vector<std::vector<segment_type>> levels; // The routing levels, levels[0] is built on keys
+
+    /**
+     * Returns the index of the last entry not greater than key in the window of size 2 * (Error + 2) around
+     * the predicted position pos.
+     */
+    template <typename RandomIt, typename Compare>
+    static size_t search_window(RandomIt first, size_t size, size_t pos, const KeyType &key, Compare comp)
+    {
+        size_t lo = pos <= Error + 2 ? 0 : pos - (Error + 2);
+        size_t hi = std::min<size_t>(pos + Error + 2, size);
+        return std::upper_bound(first + lo, first + hi, key, comp) - first - 1;
+    }
+
+public:
+    LearnedRouter() = default;
+
+    /**
+     * Constructs the router on the start keys of the segments.
+     * @param first, last the range containing the start keys, must be sorted and unique
+     */
+    template <typename RandomIt>
+    LearnedRouter(RandomIt first, RandomIt last) : keys(first, last), levels()
+    {
+        if (keys.size() > std::numeric_limits<segment_id>::max())
+            throw std::length_error("the number of segments exceeds the range of segment ids");
+
+        using pair_type = std::pair<KeyType, segment_id>;
+
+        auto level_size = keys.size();
+        auto in_keys = [this](auto i) { return pair_type(keys[i], segment_id(i)); };
+        auto in_level = [this](auto i) { return pair_type(levels.back()[i].get_start_key(), segment_id(i)); };
+
+        while (level_size * (levels.empty() ? sizeof(KeyType) : sizeof(segment_type)) > cache_line_size)
+        {
+            std::vector<segment_type> level;
+            auto out_fun = [&level](auto segment) { level.emplace_back(segment); };
+
+            if (levels.empty())
+                get_all_segments<Floating>(level_size, Error, in_keys, out_fun);
+            else
+                get_all_segments<Floating>(level_size, Error, in_level, out_fun);
+
+            // The shrinking cone cannot reduce a level made of single-key segments
+            if (level.size() == level_size)
+                break;
+
+            level.shrink_to_fit();
+            level_size = level.size();
+            levels.push_back(std::move(level));
+        }
+    }
+
+    /**
+     * Returns the index of the segment with the largest start key not greater than the given key.
+     * @param key a key not smaller than the first start key
+     * @return the index of the segment
+     */
+    size_t find(const KeyType &key) const
+    {
+        auto key_less = [](const KeyType &k, const KeyType &s) { return k < s; };
+        auto segment_less = [](const KeyType &k, const segment_type &s) { return k < s.get_start_key(); };
+
+        if (levels.empty())
+            return std::upper_bound(keys.begin(), keys.end(), key, key_less) - keys.begin() - 1;
+
+        auto &top = levels.back();
+        size_t i = std::upper_bound(top.begin(), top.end(), key, segment_less) - top.begin() - 1;
+
+        for (size_t l = levels.size(); l-- > 0;)
+        {
+            // Keys past the end of a routing segment are predicted at its last key, whose entry is the answer
+            auto &segment = levels[l][i];
+            size_t pos = segment.predict(std::min(key, segment.get_end_key()));
+
+            if (l == 0)
+                i = search_window(keys.begin(), keys.size(), pos, key, key_less);
+            else
+                i = search_window(levels[l - 1].begin(), levels[l - 1].size(), pos, key, segment_less);
+        }
+
+        return i;
+    }
+
+    /**
+     * Finds the segments of a batch of keys. The lookups descend the levels together: for every level, the
+     * predictions of all the keys are computed and their search windows prefetched before any window is
+     * searched, then the routing segments of the next level are prefetched in the same way.
+     * @param queries the keys, each not smaller than the first start key
+     * @param count the number of keys
+     * @param out the array receiving the indices of the segments
+     */
+    void find_batch(const KeyType *queries, size_t count, size_t *out) const
+    {
+        auto key_less = [](const KeyType &k, const KeyType &s) { return k < s; };
+        auto segment_less = [](const KeyType &k, const segment_type &s) { return k < s.get_start_key(); };
+
+        if (levels.empty())
+        {
+            for (size_t j = 0; j < count; ++j)
+                out[j] = find(queries[j]);
+            return;
+        }
+
+        auto &top = levels.back();
+        for (size_t j = 0; j < count; ++j)
+            out[j] = std::upper_bound(top.begin(), top.end(), queries[j], segment_less) - top.begin() - 1;
+
+        for (size_t l = levels.size(); l-- > 0;)
+        {
+            for (size_t j = 0; j < count; ++j)
+            {
+                auto &segment = levels[l][out[j]];
+                out[j] = segment.predict(std::min(queries[j], segment.get_end_key()));
+                if (l == 0)
+                    __builtin_prefetch(keys.data() + std::min(out[j], keys.size() - 1));
+                else
+                    __builtin_prefetch(levels[l - 1].data() + std::min(out[j], levels[l - 1].size() - 1));
+            }
+
+            for (size_t j = 0; j < count; ++j)
+            {
+                if (l == 0)
+                {
+                    out[j] = search_window(keys.begin(), keys.size(), out[j], queries[j], key_less);
+                }
+                else
+                {
+                    out[j] = search_window(levels[l - 1].begin(), levels[l - 1].size(), out[j], queries[j], segment_less);
+                    __builtin_prefetch(&levels[l - 1][out[j]]);
+                }
+            }
+        }
+    }
+};
+
+#endif
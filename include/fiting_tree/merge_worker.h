@@ -0,0 +1,135 @@
+#ifndef MERGE_WORKER_H
+#define MERGE_WORKER_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <optional>
+#include <type_traits>
+#include <condition_variable>
+
+/**
+ * A thread running the jobs submitted to it in order. At most capacity jobs wait or run at the same
+ * time, and a submission beyond that blocks until a job is done. The results are handed back to the
+ * thread submitting the jobs, which is the only one expected to call the methods of the worker.
+ * @tparam Job the type of the jobs
+ * @tparam Function the type of the function run on every job, returning its result
+ */
+template <typename Job, typename Function>
+class MergeWorker
+{
+public:
+    using result_type = std::invoke_result_t<Function, Job &>;
+
+private:
+    Function function;
+    size_t capacity;
+    size_t busy;                     // The number of jobs waiting or running
+    bool stopping;
+    std::atomic<size_t> num_results; // The size of results, read without the lock by poll
+    std::deque<Job> jobs;
+    std::deque<result_type> results;
+    std::mutex mutex;
+    std::condition_variable job_added;
+    std::condition_variable job_done;
+    std::thread thread;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            job_added.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+                return;
+
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            auto result = function(job);
+            lock.lock();
+
+            results.push_back(std::move(result));
+            num_results.store(results.size(), std::memory_order_release);
+            --busy;
+            job_done.notify_all();
+        }
+    }
+
+    result_type pop_result()
+    {
+        auto result = std::move(results.front());
+        results.pop_front();
+        num_results.store(results.size(), std::memory_order_release);
+        return result;
+    }
+
+public:
+    /**
+     * Starts a worker.
+     * @param capacity the maximum number of jobs waiting or running
+     * @param function the function run on every job
+     */
+    MergeWorker(size_t capacity, Function function)
+        : function(function), capacity(capacity), busy(0), stopping(false), num_results(0), jobs(), results(), thread(&MergeWorker::run, this)
+    {
+    }
+
+    MergeWorker(const MergeWorker &) = delete;
+    MergeWorker &operator=(const MergeWorker &) = delete;
+
+    /**
+     * Stops the worker. The jobs still waiting are dropped, and the one running is finished first.
+     */
+    ~MergeWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        job_added.notify_one();
+        thread.join();
+    }
+
+    /**
+     * Submits a job, waiting first for a job to be done if capacity jobs are waiting or running.
+     * @param job the job to run
+     */
+    void submit(Job job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [this] { return busy < capacity; });
+        jobs.push_back(std::move(job));
+        ++busy;
+        lock.unlock();
+        job_added.notify_one();
+    }
+
+    /**
+     * Returns the result of the oldest job done whose result was not returned yet, without waiting.
+     * @return the result, or nothing if no such job is done
+     */
+    std::optional<result_type> poll()
+    {
+        if (num_results.load(std::memory_order_acquire) == 0)
+            return std::nullopt;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        return pop_result();
+    }
+
+    /**
+     * Returns the result of the oldest job done whose result was not returned yet, waiting for a job to be
+     * done if there is none. A job whose result was not returned must have been submitted.
+     * @return the result
+     */
+    result_type wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [this] { return !results.empty(); });
+        return pop_result();
+    }
+};
+
+#endif
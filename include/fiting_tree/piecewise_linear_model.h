@@ -1,25 +1,37 @@
 #ifndef PLM_H
 #define PLM_H
 
+#include <limits>
+#include <memory>
 #include <vector>
+#include <thread>
 #include <cstddef>
+#include <algorithm>
+#include <stdexcept>
 #include <type_traits>
 
 #include "segment.h"
 #include "buffered_segment.h"
+#include "gapped_segment.h"
 
 template <typename T>
 using LargeSigned = typename std::conditional_t<std::is_floating_point_v<T>,
                                                 long double,
                                                 std::conditional_t<(sizeof(T) < 8), int64_t, __int128>>;
 
-template <typename X, typename Y>
+template <typename X, typename Y, typename Floating = long double>
 class PiecewiseLinearModel
 {
 private:
     using SX = LargeSigned<X>;
     using SY = LargeSigned<Y>;
 
+    // A product of slopes multiplies a difference of keys by a difference of positions widened by the error,
+    // so 32-bit keys and positions already need more than 64 bits
+    using product_type = std::conditional_t<std::is_floating_point_v<X> || std::is_floating_point_v<Y>,
+                                            decltype(SX() * SY()),
+                                            std::conditional_t<(sizeof(X) + sizeof(Y) <= 6), int64_t, __int128>>;
+
     struct Slope
     {
         SX dx{};
@@ -27,22 +39,31 @@ private:
 
         inline bool operator<(const Slope &p) const
         {
-            return dy * p.dx < dx * p.dy;
+            return this->template less<product_type>(p);
         }
 
         inline bool operator>(const Slope &p) const
         {
-            return dy * p.dx > dx * p.dy;
+            return p.template less<product_type>(*this);
         }
 
         inline bool operator==(const Slope &p) const
         {
-            return dy * p.dx == dx * p.dy;
+            return product_type(dy) * product_type(p.dx) == product_type(dx) * product_type(p.dy);
         }
 
         inline bool operator!=(const Slope &p) const
         {
-            return dy * p.dx != dx * p.dy;
+            return !(*this == p);
+        }
+
+        /**
+         * Compares the slopes with products of type T, which must hold them exactly.
+         */
+        template <typename T>
+        inline bool less(const Slope &p) const
+        {
+            return T(dy) * T(p.dx) < T(dx) * T(p.dy);
         }
 
         explicit operator long double() const
@@ -62,20 +83,77 @@ private:
         }
     };
 
-    const Y error;
+    static constexpr uint64_t max_span = max_segment_span<X, Floating>();
+
+    // The products of the slopes are wider than 64 bits for 32-bit or wider keys and positions, but every
+    // slope of a segment has a dx and a |dy| at most those of its last point, plus the error. While these fit
+    // in 31 bits, the slopes are compared with 64-bit products instead
+    static constexpr bool has_narrow_path = std::is_same_v<product_type, __int128>;
+    static constexpr SY narrow_limit = SY(1) << 31;
+
+    // Not const, so that the models and the segmenters holding them can be assigned
+    Y error;
+    uint64_t span_limit; // The largest difference between the positions of the points of a segment
     Point first_point;
     Point last_point;
     Slope lower_slope = {1, 0};
     Slope upper_slope = {0, 1};
     size_t points_in_segment = 0;
+    bool segment_ended = false; // Whether a point was rejected, so that the next one starts a new segment
+
+    /**
+     * Narrows the cone of the slopes of the segment to a new point, if the point is inside it.
+     * @tparam T the type of the products comparing the slopes
+     * @param current_point, p1, p2 the point, raised and lowered by the error
+     * @return false if the point is outside the cone, which ends the segment
+     */
+    template <typename T>
+    bool shrink_cone(const Point &current_point, const Point &p1, const Point &p2)
+    {
+        Slope slope = current_point - first_point;
+        bool outside_lower_slope = slope.template less<T>(lower_slope);
+        bool outside_upper_slope = upper_slope.template less<T>(slope);
+
+        if (outside_lower_slope || outside_upper_slope)
+        {
+            segment_ended = true;
+            return false;
+        }
+
+        Slope upper = p1 - first_point;
+        if (upper.template less<T>(upper_slope))
+        {
+            upper_slope = upper;
+        }
+
+        Slope lower = p2 - first_point;
+        if (lower_slope.template less<T>(lower))
+        {
+            lower_slope = lower;
+        }
+
+        last_point = current_point;
+        ++points_in_segment;
+        return true;
+    }
 
 public:
-    explicit PiecewiseLinearModel(Y error) : error(error)
+    /**
+     * Constructs a model.
+     * @param error the maximum error allowed for every segment
+     * @param max_length the maximum number of positions spanned by a segment, which is cut earlier if needed
+     */
+    explicit PiecewiseLinearModel(Y error, uint64_t max_length = std::numeric_limits<uint64_t>::max())
+        : error(error), span_limit(std::min<uint64_t>(max_span, max_length - 1))
     {
         if (error < 0)
         {
             throw std::invalid_argument("error can't be less than zero");
         }
+        if (max_length == 0)
+        {
+            throw std::invalid_argument("max_length can't be zero");
+        }
     }
 
     bool add_point(const X &x, const Y &y)
@@ -84,6 +162,14 @@ public:
         Point p1{x, SY(y) + error};
         Point p2{x, SY(y) - error};
 
+        // The points of an ended segment are counted until then, so that get_segment tells a segment of one
+        // point from the cone of a longer one
+        if (segment_ended)
+        {
+            points_in_segment = 0;
+            segment_ended = false;
+        }
+
         if (points_in_segment == 0)
         {
             first_point = current_point;
@@ -94,6 +180,12 @@ public:
             return true;
         }
 
+        if (SY(y) - first_point.y > SY(span_limit))
+        {
+            segment_ended = true;
+            return false;
+        }
+
         if (points_in_segment == 1)
         {
             lower_slope = p2 - first_point;
@@ -103,69 +195,376 @@ public:
             return true;
         }
 
-        Slope slope = current_point - first_point;
-        bool outside_lower_slope = slope < lower_slope;
-        bool outside_upper_slope = slope > upper_slope;
+        if constexpr (has_narrow_path)
+        {
+            if (SX(x) - first_point.x < narrow_limit && SY(y) - first_point.y + error < narrow_limit)
+                return shrink_cone<int64_t>(current_point, p1, p2);
+        }
+        return shrink_cone<product_type>(current_point, p1, p2);
+    }
 
-        if (outside_lower_slope || outside_upper_slope)
+    Segment<X, Y, Floating> get_segment()
+    {
+        if (points_in_segment == 1)
+            return Segment<X, Y, Floating>((X)first_point.x, (Y)first_point.y, (X)last_point.x, Floating(1));
+        long double u_slope = (long double)upper_slope;
+        long double l_slope = (long double)lower_slope;
+        long double slope = (u_slope + l_slope) / 2;
+        return Segment<X, Y, Floating>(X(first_point.x), Y(first_point.y), X(last_point.x), Floating(slope));
+    }
+
+    template <typename SegmentType, typename PairVector>
+    SegmentType get_buffered_segment(const PairVector &keys, const typename SegmentType::allocator_type &alloc)
+    {
+        if (points_in_segment == 1)
+            return SegmentType((X)first_point.x, (Y)first_point.y, (X)last_point.x, Floating(1), 0, keys, alloc);
+        long double u_slope = (long double)upper_slope;
+        long double l_slope = (long double)lower_slope;
+        long double slope = (u_slope + l_slope) / 2;
+        return SegmentType(X(first_point.x), Y(first_point.y), X(last_point.x), Floating(slope), 0, keys, alloc);
+    }
+};
+
+/**
+ * Segments points with the optimal piecewise linear approximation of O'Rourke, which yields the fewest
+ * segments for the error. Unlike the shrinking cone, the line of a segment need not pass through its first
+ * point: the lower convex hull of the points raised by the error and the upper convex hull of the points
+ * lowered by it bound the lines fitting every point so far, and each point is added in amortized constant
+ * time.
+ *
+ * The line is stored as the slope from the first key plus the shift of its prediction there, rounded to an
+ * integer, see predict_offset. The rounded predictions are then within error + 1 positions of the keys, as
+ * with the shrinking cone. The error of the first point of a segment is capped to the range of an int16_t,
+ * which bounds the shift.
+ */
+template <typename X, typename Y, typename Floating = long double>
+class OptimalPiecewiseLinearModel
+{
+private:
+    using SX = LargeSigned<X>;
+    using SY = LargeSigned<Y>;
+
+    // As in PiecewiseLinearModel, the products of the differences need more than 64 bits for 32-bit keys and
+    // positions
+    using product_type = std::conditional_t<std::is_floating_point_v<X> || std::is_floating_point_v<Y>,
+                                            decltype(SX() * SY()),
+                                            std::conditional_t<(sizeof(X) + sizeof(Y) <= 6), int64_t, __int128>>;
+
+    static product_type product(SX dx, SY dy)
+    {
+        return product_type(dx) * product_type(dy);
+    }
+
+    struct Slope
+    {
+        SX dx{};
+        SY dy{};
+
+        inline bool operator<(const Slope &p) const
+        {
+            return product(p.dx, dy) < product(dx, p.dy);
+        }
+
+        inline bool operator>(const Slope &p) const
+        {
+            return product(p.dx, dy) > product(dx, p.dy);
+        }
+
+        inline bool operator==(const Slope &p) const
+        {
+            return product(p.dx, dy) == product(dx, p.dy);
+        }
+
+        explicit operator long double() const
+        {
+            return dy / (long double)dx;
+        }
+    };
+
+    struct Point
+    {
+        X x{};
+        SY y{};
+
+        inline Slope operator-(const Point &p) const
+        {
+            return {SX(x) - p.x, y - p.y};
+        }
+    };
+
+    static constexpr uint64_t max_span = max_segment_span<X, Floating>();
+    static constexpr SY max_shift = std::numeric_limits<int16_t>::max();
+
+    SY error;
+    SY first_error;      // The error of the first point of a segment, which bounds the shift
+    uint64_t span_limit; // The largest difference between the positions of the points of a segment
+    X first_x{};
+    SY first_y{};
+    X last_x{};
+    std::vector<Point> upper; // The lower convex hull of the raised points
+    std::vector<Point> lower; // The upper convex hull of the lowered points
+    size_t upper_start = 0;   // The first point of upper still bounding the slopes
+    size_t lower_start = 0;   // The first point of lower still bounding the slopes
+    size_t points_in_segment = 0;
+    bool segment_ended = false; // Whether a point was rejected, so that the next one starts a new segment
+
+    // The line of smallest slope goes from rectangle[0] to rectangle[2], and the one of largest slope from
+    // rectangle[1] to rectangle[3]. The raised points are 0 and 3, and the lowered ones 1 and 2
+    Point rectangle[4];
+
+    static auto cross(const Point &o, const Point &a, const Point &b)
+    {
+        auto oa = a - o;
+        auto ob = b - o;
+        return product(oa.dx, ob.dy) - product(ob.dx, oa.dy);
+    }
+
+    /**
+     * Returns the slope of a line fitting the points of the segment and the shift of its prediction at the
+     * first point. The lines bounding the slopes cross within the fitting lines, so the line through their
+     * intersection with the mean of their slopes fits.
+     */
+    std::pair<long double, int16_t> get_line() const
+    {
+        if (points_in_segment == 1)
+            return {1, 0};
+
+        Slope min_slope = rectangle[2] - rectangle[0];
+        Slope max_slope = rectangle[3] - rectangle[1];
+
+        long double x = rectangle[0].x;
+        long double y = rectangle[0].y;
+        if (!(min_slope == max_slope))
+        {
+            Slope d = rectangle[1] - rectangle[0];
+            long double t = (long double)(product(d.dx, max_slope.dy) - product(max_slope.dx, d.dy)) /
+                            (long double)(product(min_slope.dx, max_slope.dy) - product(max_slope.dx, min_slope.dy));
+            x += t * (long double)min_slope.dx;
+            y += t * (long double)min_slope.dy;
+        }
+
+        long double slope = std::max<long double>(((long double)min_slope + (long double)max_slope) / 2, 0);
+        long double shift = std::round(y - (x - (long double)first_x) * slope - (long double)first_y);
+        return {slope, int16_t(std::clamp<long double>(shift, -(long double)first_error, (long double)first_error))};
+    }
+
+public:
+    /**
+     * Constructs a model.
+     * @param error the maximum error allowed for every segment
+     * @param max_length the maximum number of positions spanned by a segment, which is cut earlier if needed
+     */
+    explicit OptimalPiecewiseLinearModel(Y error, uint64_t max_length = std::numeric_limits<uint64_t>::max())
+        : error(error), first_error(std::min(SY(error), max_shift)),
+          span_limit(std::min<uint64_t>(max_span, max_length - 1))
+    {
+        if (error < 0)
+        {
+            throw std::invalid_argument("error can't be less than zero");
+        }
+        if (max_length == 0)
+        {
+            throw std::invalid_argument("max_length can't be zero");
+        }
+    }
+
+    bool add_point(const X &x, const Y &y)
+    {
+        // As in PiecewiseLinearModel, the points of an ended segment are counted until the next one starts
+        if (segment_ended)
         {
             points_in_segment = 0;
-            return false;
+            segment_ended = false;
         }
 
-        if (p1 - first_point < upper_slope)
+        if (points_in_segment > 0 && SY(y) - first_y > SY(span_limit))
         {
-            upper_slope = p1 - first_point;
+            segment_ended = true;
+            return false;
         }
 
-        if (p2 - first_point > lower_slope)
+        SY e = points_in_segment == 0 ? first_error : error;
+        Point p1{x, SY(y) + e};
+        Point p2{x, SY(y) - e};
+
+        if (points_in_segment == 0)
         {
-            lower_slope = p2 - first_point;
+            first_x = x;
+            first_y = y;
+            rectangle[0] = p1;
+            rectangle[1] = p2;
+            upper.clear();
+            lower.clear();
+            upper.push_back(p1);
+            lower.push_back(p2);
+            upper_start = 0;
+            lower_start = 0;
+        }
+        else if (points_in_segment == 1)
+        {
+            rectangle[2] = p2;
+            rectangle[3] = p1;
+            upper.push_back(p1);
+            lower.push_back(p2);
+        }
+        else
+        {
+            Slope min_slope = rectangle[2] - rectangle[0];
+            Slope max_slope = rectangle[3] - rectangle[1];
+            if (p1 - rectangle[2] < min_slope || p2 - rectangle[3] > max_slope)
+            {
+                segment_ended = true;
+                return false;
+            }
+
+            // The raised point lowers the largest slope, which then joins it to the point of the lower hull
+            // of smallest slope to it, and the points of the upper hull before that one no longer matter
+            if (p1 - rectangle[1] < max_slope)
+            {
+                size_t i = lower_start;
+                Slope smallest = p1 - lower[i];
+                for (; i + 1 < lower.size() && !(p1 - lower[i + 1] > smallest); ++i)
+                    smallest = p1 - lower[i + 1];
+
+                rectangle[1] = lower[i];
+                rectangle[3] = p1;
+                lower_start = i;
+
+                size_t end = upper.size();
+                while (end >= upper_start + 2 && cross(upper[end - 2], upper[end - 1], p1) <= 0)
+                    --end;
+                upper.resize(end);
+                upper.push_back(p1);
+            }
+
+            // Symmetrically, the lowered point raises the smallest slope
+            if (p2 - rectangle[0] > min_slope)
+            {
+                size_t i = upper_start;
+                Slope largest = p2 - upper[i];
+                for (; i + 1 < upper.size() && !(p2 - upper[i + 1] < largest); ++i)
+                    largest = p2 - upper[i + 1];
+
+                rectangle[0] = upper[i];
+                rectangle[2] = p2;
+                upper_start = i;
+
+                size_t end = lower.size();
+                while (end >= lower_start + 2 && cross(lower[end - 2], lower[end - 1], p2) >= 0)
+                    --end;
+                lower.resize(end);
+                lower.push_back(p2);
+            }
         }
 
-        last_point = current_point;
+        last_x = x;
         ++points_in_segment;
         return true;
     }
 
-    Segment<X, Y> get_segment()
+    Segment<X, Y, Floating> get_segment() const
     {
-        if (points_in_segment == 1)
-            return Segment<X, Y>((X)first_point.x, (Y)first_point.y, (X)last_point.x, 1);
-        long double u_slope = (long double)upper_slope;
-        long double l_slope = (long double)lower_slope;
-        long double slope = (u_slope + l_slope) / 2;
-        return Segment<X, Y>(X(first_point.x), Y(first_point.y), X(last_point.x), slope);
+        auto [slope, shift] = get_line();
+        return Segment<X, Y, Floating>(first_x, Y(first_y), last_x, Floating(slope), shift);
     }
 
-    BufferedSegment<X, Y> get_buffered_segment(std::vector<std::pair<X, Y>> &keys, const uint64_t &buf_size)
+    template <typename SegmentType, typename PairVector>
+    SegmentType get_buffered_segment(const PairVector &keys, const typename SegmentType::allocator_type &alloc) const
     {
-        if (points_in_segment == 1)
-            return BufferedSegment<X, Y>((X)first_point.x, (Y)first_point.y, (X)last_point.x, 1, keys, buf_size);
-        long double u_slope = (long double)upper_slope;
-        long double l_slope = (long double)lower_slope;
-        long double slope = (u_slope + l_slope) / 2;
-        return BufferedSegment<X, Y>(X(first_point.x), Y(first_point.y), X(last_point.x), slope, keys, buf_size);
+        auto [slope, shift] = get_line();
+        return SegmentType(first_x, Y(first_y), last_x, Floating(slope), shift, keys, alloc);
     }
 };
 
-template <typename Fin, typename Fout>
-size_t get_all_segments(size_t n, size_t error, Fin in, Fout out)
+/**
+ * The segmentation policies, selecting the model that cuts the keys into segments. ShrinkingCone fixes the
+ * line of every segment at its first key and is the fastest, while OptimalPLA finds the fewest segments for
+ * the error, at the price of keeping the convex hulls of the points of the current segment.
+ */
+struct ShrinkingCone
 {
-    if (n == 0)
+    template <typename X, typename Y, typename Floating>
+    using model_type = PiecewiseLinearModel<X, Y, Floating>;
+};
+
+struct OptimalPLA
+{
+    template <typename X, typename Y, typename Floating>
+    using model_type = OptimalPiecewiseLinearModel<X, Y, Floating>;
+};
+
+/**
+ * Detects the segment types that record the error bounds of their model, see fit_error_bounds.
+ */
+template <typename SegmentType, typename = void>
+struct has_error_bounds : std::false_type
+{
+};
+
+template <typename SegmentType>
+struct has_error_bounds<SegmentType, std::void_t<decltype(std::declval<SegmentType &>().set_error_bounds(0, 0))>> : std::true_type
+{
+};
+
+/**
+ * Records in a segment the largest distances of the positions of its keys below and above their rounded
+ * predictions. A repeated key is predicted at its first occurrence, as in the segmentation, while a key
+ * that is not indexed ranks after the last occurrence of the key before it, so the distance above is
+ * measured to the last occurrence.
+ * @param segment the segment to update
+ * @param first, last the range of indices of the keys in the segment
+ * @param in a function returning the (key, position) pair at a given index
+ */
+template <typename SegmentType, typename Fin>
+void fit_error_bounds(SegmentType &segment, size_t first, size_t last, Fin in)
+{
+    uint64_t below = 0;
+    uint64_t above = 0;
+
+    for (size_t i = first; i < last;)
+    {
+        auto kv = in(i);
+        size_t run_end = i + 1;
+        while (run_end < last && in(run_end).first == kv.first)
+            ++run_end;
+
+        uint64_t pred = segment.predict(kv.first);
+        uint64_t pos = kv.second;
+        uint64_t last_pos = in(run_end - 1).second;
+        below = std::max(below, pred > pos ? pred - pos : 0);
+        above = std::max(above, last_pos > pred ? last_pos - pred : 0);
+        i = run_end;
+    }
+
+    segment.set_error_bounds(below, above);
+}
+
+/**
+ * Segments the keys at positions [first, last).
+ * @tparam Segmentation the segmentation policy, ShrinkingCone or OptimalPLA
+ * @param first, last the range of positions to segment
+ * @param error the maximum error allowed for every segment
+ * @param in a function returning the (key, position) pair at a given index
+ * @param out a function called with every segment and the index of its first key
+ * @return the number of segments created
+ */
+template <typename Floating = long double, typename Segmentation = ShrinkingCone, typename Fin, typename Fout>
+size_t get_segments_in_range(size_t first, size_t last, size_t error, Fin in, Fout out)
+{
+    if (first >= last)
         return 0;
 
     using X = typename std::invoke_result_t<Fin, size_t>::first_type;
     using Y = typename std::invoke_result_t<Fin, size_t>::second_type;
 
     size_t num_segments = 0;
-    size_t start = 0;
-    auto kv = in(0);
+    size_t start = first;
+    auto kv = in(first);
 
-    PiecewiseLinearModel<X, Y> plm(error);
+    typename Segmentation::template model_type<X, Y, Floating> plm(error);
     plm.add_point(kv.first, kv.second);
 
-    for (size_t i = 1; i < n; ++i)
+    for (size_t i = first + 1; i < last; ++i)
     {
         auto next_kv = in(i);
         if (i != start && next_kv.first == kv.first)
@@ -174,63 +573,338 @@ size_t get_all_segments(size_t n, size_t error, Fin in, Fout out)
         kv = next_kv;
         if (!plm.add_point(kv.first, kv.second))
         {
-            out(plm.get_segment());
+            auto segment = plm.get_segment();
+            fit_error_bounds(segment, start, i, in);
+            out(segment, start);
             start = i;
             --i;
             ++num_segments;
         }
     }
 
-    out(plm.get_segment());
+    auto segment = plm.get_segment();
+    fit_error_bounds(segment, start, last, in);
+    out(segment, start);
     return ++num_segments;
 }
 
-template <typename Fin, typename Fout>
-size_t get_all_segments_buffered(size_t n, size_t error, uint64_t buf_size, Fin in, Fout out)
+template <typename Floating = long double, typename Segmentation = ShrinkingCone, typename Fin, typename Fout>
+size_t get_all_segments(size_t n, size_t error, Fin in, Fout out)
 {
-    if (n == 0)
-        return 0;
+    return get_segments_in_range<Floating, Segmentation>(0, n, error, in, [&out](auto segment, size_t) { out(segment); });
+}
+
+/**
+ * Segments the keys using multiple threads. The input is split into chunks that are segmented
+ * independently, then the chunks are stitched by re-running the segmentation from the last segment
+ * of every chunk until it starts a segment at the same position as the next chunk did. Since both
+ * segmentation policies are deterministic from a given starting point, the output is identical to the
+ * one of @ref get_all_segments.
+ *
+ * @tparam Segmentation the segmentation policy, ShrinkingCone or OptimalPLA
+ * @param n the number of keys
+ * @param error the maximum error allowed for every segment
+ * @param num_threads the number of threads to use, 0 means one per hardware thread
+ * @param in a function returning the (key, position) pair at a given index, must be thread-safe
+ * @param out a function called with every segment, in order, from the calling thread
+ * @return the number of segments created
+ */
+template <typename Floating = long double, typename Segmentation = ShrinkingCone, typename Fin, typename Fout>
+size_t get_all_segments_parallel(size_t n, size_t error, size_t num_threads, Fin in, Fout out)
+{
+    constexpr size_t min_chunk_size = 1ull << 16;
+
+    if (num_threads == 0)
+        num_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, n / min_chunk_size);
+
+    if (num_threads <= 1)
+        return get_all_segments<Floating, Segmentation>(n, error, in, out);
 
     using X = typename std::invoke_result_t<Fin, size_t>::first_type;
     using Y = typename std::invoke_result_t<Fin, size_t>::second_type;
+    using model_type = typename Segmentation::template model_type<X, Y, Floating>;
+    using segment_type = decltype(std::declval<model_type>().get_segment());
+    using chunk_type = std::vector<std::pair<segment_type, size_t>>;
+
+    // Chunk boundaries never split a run of repeated keys
+    std::vector<size_t> bounds{0};
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+        size_t b = std::max(t * n / num_threads, bounds.back() + 1);
+        while (b < n && in(b).first == in(b - 1).first)
+            ++b;
+        if (b >= n)
+            break;
+        bounds.push_back(b);
+    }
+    bounds.push_back(n);
+
+    size_t num_chunks = bounds.size() - 1;
+    std::vector<chunk_type> chunks(num_chunks);
+    auto segment_chunk = [&](size_t c) {
+        get_segments_in_range<Floating, Segmentation>(bounds[c], bounds[c + 1], error, in,
+                              [&chunk = chunks[c]](auto segment, size_t i) { chunk.emplace_back(segment, i); });
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_chunks - 1);
+    for (size_t c = 1; c < num_chunks; ++c)
+        workers.emplace_back(segment_chunk, c);
+    segment_chunk(0);
+    for (auto &worker : workers)
+        worker.join();
 
-    std::vector<std::pair<X, Y>> keys;
+    // The last segment of a chunk is cut at the chunk boundary, so it is re-fitted together with
+    // the following keys until the cone closes at a segment start of a later chunk
     size_t num_segments = 0;
-    size_t start = 0;
-    auto kv = in(0);
+    for (auto it = chunks[0].begin(); it != std::prev(chunks[0].end()); ++it, ++num_segments)
+        out(it->first);
 
-    PiecewiseLinearModel<X, Y> plm(error);
+    size_t c = 1;
+    size_t start = chunks[0].back().second;
+    auto kv = in(start);
+
+    model_type plm(error);
     plm.add_point(kv.first, kv.second);
-    keys.emplace_back(kv.first, kv.second);
 
-    for (size_t i = 1; i < n; ++i)
+    for (size_t i = start + 1; i < n; ++i)
     {
         auto next_kv = in(i);
         if (i != start && next_kv.first == kv.first)
-        {
-            keys.emplace_back(kv.first, kv.second);
             continue;
-        }
 
         kv = next_kv;
-        if (!plm.add_point(kv.first, kv.second))
-        {
-            out(plm.get_buffered_segment(keys, buf_size));
-            start = i;
-            --i;
-            ++num_segments;
-            keys.clear();
+        if (plm.add_point(kv.first, kv.second))
             continue;
+
+        auto segment = plm.get_segment();
+        fit_error_bounds(segment, start, i, in);
+        out(segment);
+        ++num_segments;
+        start = i;
+
+        size_t d = c;
+        while (d < num_chunks && bounds[d + 1] <= i)
+            ++d;
+
+        if (d < num_chunks && bounds[d] <= i)
+        {
+            auto &chunk = chunks[d];
+            auto sync_it = std::lower_bound(chunk.begin(), chunk.end(), i,
+                                            [](const auto &s, size_t pos) { return s.second < pos; });
+
+            if (sync_it != chunk.end() && sync_it->second == i)
+            {
+                bool last_chunk = d + 1 == num_chunks;
+                auto stop = last_chunk ? chunk.end() : std::prev(chunk.end());
+                for (; sync_it != stop; ++sync_it, ++num_segments)
+                    out(sync_it->first);
+
+                if (last_chunk)
+                    return num_segments;
+
+                start = chunk.back().second;
+                c = d + 1;
+            }
         }
 
-        keys.emplace_back(kv.first, kv.second);
+        i = start - 1;
     }
 
-    out(plm.get_buffered_segment(keys, buf_size));
+    auto segment = plm.get_segment();
+    fit_error_bounds(segment, start, n, in);
+    out(segment);
     return ++num_segments;
 }
 
-template <typename RandomIterator>
+/**
+ * Segments a stream of keys into buffered segments, which store their
+ * keys. The keys are pushed one at a time and every segment is emitted as soon as it is complete, so that a
+ * segmentation can be spread over many calls. The segments model the index of every key in the stream,
+ * while the position paired with a key is the payload stored with it.
+ * @tparam Floating the type used to store the slopes
+ * @tparam SegmentType the type of the segments, a BufferedSegment or a GappedSegment
+ * @tparam Segmentation the segmentation policy, ShrinkingCone or OptimalPLA
+ */
+template <typename Floating, typename SegmentType, typename Segmentation = ShrinkingCone>
+class BufferedSegmenter
+{
+    using X = typename SegmentType::pair_type::first_type;
+    using Y = typename SegmentType::pair_type::second_type;
+    using allocator_type = typename SegmentType::allocator_type;
+    using pair_allocator_type = typename std::allocator_traits<allocator_type>::template rebind_alloc<std::pair<X, Y>>;
+
+    typename Segmentation::template model_type<X, Y, Floating> plm;
+    allocator_type allocator;
+    std::vector<std::pair<X, Y>, pair_allocator_type> keys; // The keys of the current segment and their payloads
+    size_t count = 0;                                       // The number of keys pushed
+    size_t start = 0;                                       // The index of the first key of the current segment
+    size_t num_segments = 0;
+
+    template <typename Fout>
+    void emit(Fout &out)
+    {
+        auto segment = plm.template get_buffered_segment<SegmentType>(keys, allocator);
+        if constexpr (has_error_bounds<SegmentType>::value)
+            fit_error_bounds(segment, start, start + keys.size(), [&](size_t i) { return std::pair<X, size_t>(keys[i - start].first, i); });
+        out(std::move(segment));
+        ++num_segments;
+        keys.clear();
+    }
+
+public:
+    /**
+     * Constructs a segmenter.
+     * @param error the maximum error allowed for every segment
+     * @param max_length the maximum number of keys in a segment, apart from the repetitions of its last key
+     * @param alloc the allocator of the segments and of the keys of the current segment
+     */
+    explicit BufferedSegmenter(size_t error, size_t max_length = std::numeric_limits<size_t>::max(), const allocator_type &alloc = allocator_type())
+        : plm(error, max_length), allocator(alloc), keys(alloc) {}
+
+    /**
+     * Pushes the next key of the stream, which must not be smaller than the previous one.
+     * @param key the key
+     * @param payload the payload stored with the key
+     * @param out a function called with every segment completed by the key
+     */
+    template <typename Fout>
+    void add(const X &key, const Y &payload, Fout out)
+    {
+        // Repeated keys are added to the segment of their first occurrence
+        if (!keys.empty() && count != start && key == keys.back().first)
+        {
+            keys.emplace_back(key, payload);
+            ++count;
+            return;
+        }
+
+        if (!plm.add_point(key, Y(count)))
+        {
+            emit(out);
+            start = count;
+            plm.add_point(key, Y(count));
+        }
+
+        keys.emplace_back(key, payload);
+        ++count;
+    }
+
+    /**
+     * Emits the last segment.
+     * @param out a function called with the segment
+     * @return the number of segments emitted
+     */
+    template <typename Fout>
+    size_t finish(Fout out)
+    {
+        if (!keys.empty())
+            emit(out);
+        return num_segments;
+    }
+};
+
+/**
+ * The (key, payload) pairs returned by a function at the indices [first, last), read on demand, so that a
+ * segment can be constructed from the input of a segmentation without copying its keys elsewhere first.
+ * @tparam Fin the type of the function returning the pair at a given index
+ */
+template <typename Fin>
+class PairRange
+{
+    const Fin &in;
+    size_t first;
+    size_t last;
+
+public:
+    class iterator
+    {
+        const Fin *in;
+        size_t i;
+
+    public:
+        iterator(const Fin *in, size_t i) : in(in), i(i) {}
+
+        auto operator*() const { return (*in)(i); }
+
+        iterator &operator++()
+        {
+            ++i;
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const { return i == other.i; }
+        bool operator!=(const iterator &other) const { return i != other.i; }
+    };
+
+    PairRange(const Fin &in, size_t first, size_t last) : in(in), first(first), last(last) {}
+
+    size_t size() const { return last - first; }
+    auto operator[](size_t i) const { return in(first + i); }
+    iterator begin() const { return iterator(&in, first); }
+    iterator end() const { return iterator(&in, last); }
+};
+
+/**
+ * Segments the keys into buffered segments, as BufferedSegmenter does.
+ * Since the keys can be read again by index, every segment is constructed directly from the input once
+ * its last key is known, and the keys are copied only into the storage of their segment.
+ * @tparam SegmentType the type of the segments, a BufferedSegment or a GappedSegment
+ * @tparam Segmentation the segmentation policy, ShrinkingCone or OptimalPLA
+ * @param n the number of keys
+ * @param error the maximum error allowed for every segment
+ * @param in a function returning the (key, payload) pair at a given index
+ * @param out a function called with every segment
+ * @param max_length the maximum number of keys in a segment, see BufferedSegmenter
+ * @param alloc the allocator of the segments
+ * @return the number of segments created
+ */
+template <typename Floating, typename SegmentType, typename Segmentation = ShrinkingCone, typename Fin, typename Fout>
+size_t get_all_segments_buffered(size_t n, size_t error, Fin in, Fout out, size_t max_length = std::numeric_limits<size_t>::max(),
+                                 const typename SegmentType::allocator_type &alloc = typename SegmentType::allocator_type())
+{
+    using X = typename SegmentType::pair_type::first_type;
+    using Y = typename SegmentType::pair_type::second_type;
+
+    if (n == 0)
+        return 0;
+
+    typename Segmentation::template model_type<X, Y, Floating> plm(error, max_length);
+    size_t start = 0; // The index of the first key of the current segment
+    size_t num_segments = 0;
+
+    auto emit = [&](size_t end) {
+        auto segment = plm.template get_buffered_segment<SegmentType>(PairRange<Fin>(in, start, end), alloc);
+        if constexpr (has_error_bounds<SegmentType>::value)
+            fit_error_bounds(segment, start, end, [&in](size_t i) { return std::pair<X, size_t>(in(i).first, i); });
+        out(std::move(segment));
+        ++num_segments;
+    };
+
+    X previous_key = in(0).first;
+    plm.add_point(previous_key, Y(0));
+    for (size_t i = 1; i < n; ++i)
+    {
+        // Repeated keys are added to the segment of their first occurrence
+        X key = in(i).first;
+        if (key == previous_key)
+            continue;
+
+        if (!plm.add_point(key, Y(i)))
+        {
+            emit(i);
+            start = i;
+            plm.add_point(key, Y(i));
+        }
+        previous_key = key;
+    }
+
+    emit(n);
+    return num_segments;
+}
+
+template <typename Segmentation = ShrinkingCone, typename RandomIterator>
 auto get_all_segments(RandomIterator first, RandomIterator last, size_t error)
 {
     using key_type = typename RandomIterator::value_type;
@@ -241,7 +915,7 @@ auto get_all_segments(RandomIterator first, RandomIterator last, size_t error)
 
     auto in_fun = [first](auto i) { return pair_type(first[i], i); };
     auto out_fun = [&out](auto segment) { out.push_back(segment); };
-    get_all_segments(n, error, in_fun, out_fun);
+    get_all_segments<long double, Segmentation>(n, error, in_fun, out_fun);
 
     return out;
 }
@@ -0,0 +1,206 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+/**
+ * The last-mile search kernels find the first key not smaller than a given key in the window [lo, hi) of a
+ * sorted array returned by the index. Every kernel exposes the same static member
+ *
+ *     size_t lower_bound(const KeyType *data, size_t lo, size_t hi, size_t pos, const KeyType &key)
+ *
+ * returning a position in [lo, hi], where pos is the predicted position of the key in the window.
+ */
+
+/**
+ * Binary search without branches on the comparisons, which compile to conditional moves.
+ */
+struct BinarySearch
+{
+    template <typename KeyType>
+    static size_t lower_bound(const KeyType *data, size_t lo, size_t hi, size_t, const KeyType &key)
+    {
+        const KeyType *base = data + lo;
+        size_t len = hi - lo;
+        if (len == 0)
+            return lo;
+
+        while (len > 1)
+        {
+            size_t half = len / 2;
+            base = base[half] < key ? base + half : base;
+            len -= half;
+        }
+
+        return (base - data) + (*base < key);
+    }
+};
+
+/**
+ * Exponential search outward from the predicted position, which touches few cache lines when the
+ * prediction is close to the key.
+ */
+struct ExponentialSearch
+{
+    template <typename KeyType>
+    static size_t lower_bound(const KeyType *data, size_t lo, size_t hi, size_t pos, const KeyType &key)
+    {
+        if (lo == hi)
+            return lo;
+
+        pos = std::clamp(pos, lo, hi - 1);
+        if (data[pos] < key)
+        {
+            size_t l = pos + 1;
+            size_t step = 1;
+            while (l + step < hi && data[l + step - 1] < key)
+            {
+                l += step;
+                step *= 2;
+            }
+            return BinarySearch::lower_bound(data, l, std::min(l + step, hi), 0, key);
+        }
+
+        size_t r = pos;
+        size_t step = 1;
+        while (r > lo + step && !(data[r - step] < key))
+        {
+            r -= step;
+            step *= 2;
+        }
+        return BinarySearch::lower_bound(data, r > lo + step ? r - step + 1 : lo, r, 0, key);
+    }
+};
+
+/**
+ * Linear scan counting the keys smaller than the sought one, with AVX-512 or AVX2 instructions when
+ * available. It avoids unpredictable branches altogether and is the fastest kernel for small windows.
+ */
+struct LinearSearch
+{
+    template <typename KeyType>
+    static size_t lower_bound(const KeyType *data, size_t lo, size_t hi, size_t, const KeyType &key)
+    {
+        size_t i = lo;
+        size_t less = 0;
+
+#if defined(__AVX512F__)
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 8)
+        {
+            const __m512i x = _mm512_set1_epi64(int64_t(key));
+            for (; i + 8 <= hi; i += 8)
+            {
+                __m512i v = _mm512_loadu_si512((const void *)(data + i));
+                __mmask8 mask = std::is_signed_v<KeyType> ? _mm512_cmplt_epi64_mask(v, x) : _mm512_cmplt_epu64_mask(v, x);
+                less += __builtin_popcount(mask);
+            }
+        }
+
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 4)
+        {
+            const __m512i x = _mm512_set1_epi32(int32_t(key));
+            for (; i + 16 <= hi; i += 16)
+            {
+                __m512i v = _mm512_loadu_si512((const void *)(data + i));
+                __mmask16 mask = std::is_signed_v<KeyType> ? _mm512_cmplt_epi32_mask(v, x) : _mm512_cmplt_epu32_mask(v, x);
+                less += __builtin_popcount(mask);
+            }
+        }
+#elif defined(__AVX2__)
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 8)
+        {
+            // Flipping the sign bit makes the signed comparison order unsigned keys
+            const __m256i flip = _mm256_set1_epi64x(std::is_signed_v<KeyType> ? 0 : std::numeric_limits<int64_t>::min());
+            const __m256i x = _mm256_xor_si256(_mm256_set1_epi64x(int64_t(key)), flip);
+            for (; i + 4 <= hi; i += 4)
+            {
+                __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), flip);
+                less += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, v))));
+            }
+        }
+
+        if constexpr (std::is_integral_v<KeyType> && sizeof(KeyType) == 4)
+        {
+            const __m256i flip = _mm256_set1_epi32(std::is_signed_v<KeyType> ? 0 : std::numeric_limits<int32_t>::min());
+            const __m256i x = _mm256_xor_si256(_mm256_set1_epi32(int32_t(key)), flip);
+            for (; i + 8 <= hi; i += 8)
+            {
+                __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + i)), flip);
+                less += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, v))));
+            }
+        }
+#endif
+
+#if defined(__AVX2__)
+        if constexpr (std::is_same_v<KeyType, double>)
+        {
+            const __m256d x = _mm256_set1_pd(key);
+            for (; i + 4 <= hi; i += 4)
+                less += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(data + i), x, _CMP_LT_OQ)));
+        }
+
+        if constexpr (std::is_same_v<KeyType, float>)
+        {
+            const __m256 x = _mm256_set1_ps(key);
+            for (; i + 8 <= hi; i += 8)
+                less += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(data + i), x, _CMP_LT_OQ)));
+        }
+#endif
+
+        for (; i < hi; ++i)
+            less += data[i] < key;
+
+        return lo + less;
+    }
+};
+
+/**
+ * Interpolation search between the endpoints of the window, which needs few probes when the keys in the
+ * window are close to uniformly spaced.
+ */
+struct InterpolationSearch
+{
+    template <typename KeyType>
+    static size_t lower_bound(const KeyType *data, size_t lo, size_t hi, size_t, const KeyType &key)
+    {
+        static_assert(std::is_arithmetic_v<KeyType>);
+
+        while (hi - lo > 8)
+        {
+            if (!(data[lo] < key))
+                return lo;
+            if (data[hi - 1] < key)
+                return hi;
+
+            // Here data[lo] < key <= data[hi - 1], hence the probe lies in [lo, hi - 1]
+            double fraction = (double(key) - double(data[lo])) / (double(data[hi - 1]) - double(data[lo]));
+            size_t probe = lo + std::min(size_t(fraction * (hi - 1 - lo)), hi - 1 - lo);
+
+            if (data[probe] < key)
+                lo = probe + 1;
+            else
+                hi = probe;
+        }
+
+        return BinarySearch::lower_bound(data, lo, hi, 0, key);
+    }
+};
+
+/**
+ * The kernel used by default for a key type and an error: a linear scan when the window spans a few cache
+ * lines of arithmetic keys, and a branchless binary search otherwise.
+ */
+template <typename KeyType, uint64_t Error>
+using DefaultSearch = std::conditional_t<std::is_arithmetic_v<KeyType> && (2 * Error + 3) * sizeof(KeyType) <= 320,
+                                         LinearSearch,
+                                         BinarySearch>;
+
+#endif
@@ -1,24 +1,40 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 
+#include <limits>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+#include "fixed_point.h"
+
 /**
  * The Segment type represents a segment created during segmentation process of the data.
  * The segments are created using the Shrinking Cone Algorithm.
  * 
  * @tparam KeyType - The type of the key to be indexed
  * @tparam PosType - The type of the positions (usually an unsigned integer type)
- * @tparam Floating - The type used to represent floating-point numbers for slope
+ * @tparam Floating - The type used to represent the slope, either a floating-point type or a FixedPoint
 */
 template <typename KeyType, typename PosType, typename Floating = long double>
 class Segment
 {
 private:
+    // The keys are stored next to each other so that narrow position and slope types do not add padding
     KeyType start_key; // The smallest key in the segment
-    PosType start_pos; // The position of the smallest key
     KeyType end_key;   // The largest key in the segment
+    PosType start_pos; // The position of the smallest key
     Floating slope;    // The slope of the segment
+    uint8_t max_below; // The largest distance of a position below its prediction, saturated
+    uint8_t max_above; // The largest distance of a position above its prediction, saturated
+    int16_t shift;     // The predicted offset of the smallest key, see predict_offset
 
 public:
+    /**
+     * The value of an error bound that was not recorded or does not fit in 8 bits
+     */
+    static constexpr uint8_t unknown_error = std::numeric_limits<uint8_t>::max();
+
     Segment() = default;
 
     /**
@@ -27,8 +43,12 @@ public:
      * @param start_pos - The position of the smallest key
      * @param end_key - The largest key in the segment
      * @param slope - The slope of the segment
+     * @param shift - The predicted offset of the smallest key, nonzero for the segmentations whose models do
+     *                not pass through the first key
      */
-    Segment(KeyType start_key, PosType start_pos, KeyType end_key, Floating slope) : start_key(start_key), start_pos(start_pos), end_key(end_key), slope(slope){};
+    Segment(KeyType start_key, PosType start_pos, KeyType end_key, Floating slope, int16_t shift = 0)
+        : start_key(start_key), end_key(end_key), start_pos(start_pos), slope(slope), max_below(unknown_error), max_above(unknown_error),
+          shift(shift){};
 
     /**
      * Returns the smallest key in the segment
@@ -39,13 +59,66 @@ public:
         return start_key;
     }
 
+    /**
+     * Returns the largest key in the segment
+     * @return the largest key
+     */
+    KeyType get_end_key() const
+    {
+        return end_key;
+    }
+
+    /**
+     * Returns the position of the smallest key in the segment
+     * @return the position of the smallest key
+     */
+    PosType get_start_pos() const
+    {
+        return start_pos;
+    }
+
+    /**
+     * Returns the largest distances of the positions of the keys in the segment below and above their
+     * predictions, or unknown_error for a bound that was not recorded or is at least unknown_error
+     * @return a std::pair of [below, above]
+     */
+    std::pair<uint8_t, uint8_t> get_error_bounds() const
+    {
+        return {max_below, max_above};
+    }
+
+    /**
+     * Records the largest distances of the positions of the keys in the segment below and above their
+     * predictions, see fit_error_bounds
+     * @param below - The largest distance below the predictions
+     * @param above - The largest distance above the predictions
+     */
+    void set_error_bounds(uint64_t below, uint64_t above)
+    {
+        max_below = uint8_t(std::min<uint64_t>(below, unknown_error));
+        max_above = uint8_t(std::min<uint64_t>(above, unknown_error));
+    }
+
     /**
      * Returns the slope and the intercept of the segment
      * @return a std::pair of [slope, intercept]
      */
     std::pair<long double, long double> get_slope_intercept() const
     {
-        return {slope, start_pos};
+        return {static_cast<long double>(slope), (long double)start_pos + shift};
+    }
+
+    /**
+     * Returns the predicted position of a key, rounded down. The result is within one position of the
+     * exact prediction as long as the segment spans at most max_segment_span<KeyType, Floating>() positions.
+     * Predictions that do not fit in PosType saturate.
+     * @param key - A key not smaller than the smallest key in the segment
+     * @return the predicted position
+     */
+    PosType predict(const KeyType &key) const
+    {
+        PosType limit = std::numeric_limits<PosType>::max() - start_pos;
+        return start_pos + PosType(std::min<uint64_t>(predict_offset(slope, start_key, key, shift), limit));
     }
 
     inline bool operator<(const Segment &s)
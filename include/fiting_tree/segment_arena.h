@@ -0,0 +1,98 @@
+#ifndef SEGMENT_ARENA_H
+#define SEGMENT_ARENA_H
+
+#include <deque>
+#include <vector>
+#include <limits>
+#include <memory>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+
+/**
+ * Owns the segments of an index, which refers to them by 32-bit ids, so that the routing tree stores
+ * small entries and moves them cheaply when its nodes are split or merged. A segment stays at the same
+ * address until it is erased, and the ids of erased segments are reused.
+ * @tparam SegmentType the type of the segments
+ * @tparam Allocator the allocator of the slots and of the free ids
+ */
+template <typename SegmentType, typename Allocator = std::allocator<SegmentType>>
+class SegmentArena
+{
+public:
+    using id_type = uint32_t;
+
+private:
+    template <typename T>
+    using rebind_alloc = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    // Never shrinks, so that the addresses of the segments are stable. An erased segment is destroyed
+    // rather than assigned, so that it releases its storage
+    std::deque<std::optional<SegmentType>, rebind_alloc<std::optional<SegmentType>>> slots;
+    std::vector<id_type, rebind_alloc<id_type>> free_ids; // The ids of the erased segments
+
+public:
+    explicit SegmentArena(const Allocator &alloc = Allocator()) : slots(alloc), free_ids(alloc) {}
+
+    /**
+     * Copies an arena, keeping the ids of the segments. The segments of the copy use the given allocator.
+     * @param other the arena to copy
+     * @param alloc the allocator of the copy
+     */
+    SegmentArena(const SegmentArena &other, const Allocator &alloc) : slots(alloc), free_ids(other.free_ids, alloc)
+    {
+        for (auto &slot : other.slots)
+        {
+            if (slot)
+                slots.emplace_back(std::in_place, *slot, typename SegmentType::allocator_type(alloc));
+            else
+                slots.emplace_back();
+        }
+    }
+
+    /**
+     * Moves a segment in the arena.
+     * @param segment the segment
+     * @return the id of the segment
+     */
+    id_type insert(SegmentType &&segment)
+    {
+        if (!free_ids.empty())
+        {
+            id_type id = free_ids.back();
+            free_ids.pop_back();
+            slots[id].emplace(std::move(segment));
+            return id;
+        }
+
+        if (slots.size() > std::numeric_limits<id_type>::max())
+            throw std::length_error("too many segments");
+
+        slots.emplace_back(std::move(segment));
+        return id_type(slots.size() - 1);
+    }
+
+    /**
+     * Destroys a segment, whose id can be returned by a later insert.
+     * @param id the id of the segment
+     */
+    void erase(id_type id)
+    {
+        slots[id].reset();
+        free_ids.push_back(id);
+    }
+
+    /**
+     * Destroys all the segments.
+     */
+    void clear()
+    {
+        slots.clear();
+        free_ids.clear();
+    }
+
+    SegmentType &operator[](id_type id) { return *slots[id]; }
+    const SegmentType &operator[](id_type id) const { return *slots[id]; }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef SIZE_CLASS_POOL_H
+#define SIZE_CLASS_POOL_H
+
+#include <new>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <memory_resource>
+
+/**
+ * A memory resource that rounds every request up to a power of two and keeps the blocks freed in a
+ * list per size, from which the later requests of the same size are served. Once the index reaches a
+ * steady state, its segments, nodes and scratch buffers are then recycled without calling the upstream
+ * resource. The blocks return to the upstream resource only when the pool is destroyed, so the pool must
+ * outlive the containers using it. The pool is thread-safe, since segments are built by the merge worker.
+ *
+ * Use it through a std::pmr::polymorphic_allocator, e.g. as the allocator of a BufferedSegment.
+ */
+class SizeClassPool : public std::pmr::memory_resource
+{
+    static constexpr size_t min_class = 4;   // The smallest block has 16 bytes, enough for the list link
+    static constexpr size_t num_classes = 60;
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    std::pmr::memory_resource *upstream;
+    FreeBlock *free_lists[num_classes] = {};
+    std::mutex mutex;
+
+    static size_t size_class(size_t bytes)
+    {
+        size_t c = bytes <= (1ull << min_class) ? min_class : 64 - __builtin_clzll(bytes - 1);
+        return c - min_class;
+    }
+
+    static size_t block_alignment(size_t c)
+    {
+        return std::min<size_t>(size_t(1) << (c + min_class), alignof(std::max_align_t));
+    }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        size_t c = size_class(bytes);
+        if (alignment > block_alignment(c))
+            return upstream->allocate(bytes, alignment);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (FreeBlock *block = free_lists[c])
+            {
+                free_lists[c] = block->next;
+                return block;
+            }
+        }
+        return upstream->allocate(size_t(1) << (c + min_class), block_alignment(c));
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override
+    {
+        size_t c = size_class(bytes);
+        if (alignment > block_alignment(c))
+        {
+            upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        free_lists[c] = new (p) FreeBlock{free_lists[c]};
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+public:
+    /**
+     * Constructs an empty pool.
+     * @param upstream the resource providing the blocks
+     */
+    explicit SizeClassPool(std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) : upstream(upstream) {}
+
+    SizeClassPool(const SizeClassPool &) = delete;
+    SizeClassPool &operator=(const SizeClassPool &) = delete;
+
+    /**
+     * Returns the blocks that are free to the upstream resource.
+     */
+    ~SizeClassPool()
+    {
+        for (size_t c = 0; c < num_classes; ++c)
+        {
+            while (FreeBlock *block = free_lists[c])
+            {
+                free_lists[c] = block->next;
+                upstream->deallocate(block, size_t(1) << (c + min_class), block_alignment(c));
+            }
+        }
+    }
+};
+
+#endif
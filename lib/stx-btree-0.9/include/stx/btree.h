@@ -280,7 +280,7 @@ private:
     struct inner_node : public node
     {
         /// Define an related allocator for the inner_node structs.
-        typedef typename _Alloc::template rebind<inner_node>::other alloc_type;
+        typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<inner_node> alloc_type;
 
         /// Keys of children or data pointers
         key_type        slotkey[innerslotmax];
@@ -319,7 +319,7 @@ private:
     struct leaf_node : public node
     {
         /// Define an related allocator for the leaf_node structs.
-        typedef typename _Alloc::template rebind<leaf_node>::other alloc_type;
+        typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<leaf_node> alloc_type;
 
         /// Double linked list pointers to traverse the leaves
         leaf_node       *prevleaf;
@@ -1361,7 +1361,9 @@ public:
         std::swap(m_tailleaf, from.m_tailleaf);
         std::swap(m_stats, from.m_stats);
         std::swap(m_key_less, from.m_key_less);
-        std::swap(m_allocator, from.m_allocator);
+        // Allocators that do not propagate on swap, e.g. std::pmr::polymorphic_allocator, must be equal
+        if constexpr (std::allocator_traits<allocator_type>::propagate_on_container_swap::value)
+            std::swap(m_allocator, from.m_allocator);
     }
 
 public:
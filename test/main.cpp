@@ -1,11 +1,100 @@
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 
 #include "catch.hpp"
 #include "fiting_tree.h"
 #include "buffered_fiting_tree.h"
+#include "size_class_pool.h"
 
+#include <map>
 #include <type_traits>
 
+/**
+ * Generates random keys, sorted and without duplicates, to bulk load an index.
+ * @tparam K - The type of the keys
+ * @param n - The number of keys generated, before the duplicates are removed
+ * @param gen - The generator of the keys
+ * @return the sorted keys
+ */
+template <typename K, typename Gen>
+std::vector<K> make_bulk(size_t n, Gen &&gen)
+{
+    std::vector<K> bulk(n);
+    for (auto &key : bulk)
+        key = gen();
+    std::sort(bulk.begin(), bulk.end());
+    bulk.erase(std::unique(bulk.begin(), bulk.end()), bulk.end());
+    return bulk;
+}
+
+/**
+ * Maps every key to its position, which is the content of an index bulk loaded with the keys.
+ * @param bulk - The sorted keys
+ * @return the map of the keys to their positions
+ */
+template <typename K>
+std::map<K, K> make_expected(const std::vector<K> &bulk)
+{
+    std::map<K, K> expected;
+    for (size_t i = 0; i < bulk.size(); ++i)
+        expected.emplace(bulk[i], i);
+    return expected;
+}
+
+/**
+ * Applies random writes to an index and to the map of its expected content, and checks that both agree
+ * on the outcome of every write. The writes cycle through an erase, an insert_or_assign and inserts.
+ * @param fiting_tree - The index
+ * @param expected - The expected content of the index
+ * @param gen - The generator of the keys
+ * @param ops - The number of writes
+ * @param erase_every - The length of the cycle, or 0 to only insert
+ */
+template <typename Tree, typename Map, typename Gen>
+void run_random_writes(Tree &fiting_tree, Map &expected, Gen &&gen, size_t ops, size_t erase_every)
+{
+    for (size_t i = 0; i < ops; ++i)
+    {
+        typename Map::key_type key = gen();
+        typename Map::mapped_type pos = i;
+        if (erase_every != 0 && i % erase_every == 0)
+            REQUIRE(fiting_tree.erase(key) == (expected.erase(key) == 1));
+        else if (erase_every != 0 && i % erase_every == 1)
+            REQUIRE(fiting_tree.insert_or_assign(key, pos) == expected.insert_or_assign(key, pos).second);
+        else
+            REQUIRE(fiting_tree.insert(key, pos) == expected.emplace(key, pos).second);
+    }
+}
+
+/**
+ * Checks that the live items of an index, in order, and the lookups of their keys match the expected
+ * content of the index.
+ * @param fiting_tree - The index
+ * @param expected - The expected content of the index
+ */
+template <typename Tree, typename Map>
+void check_contents(const Tree &fiting_tree, const Map &expected)
+{
+    auto expected_it = expected.begin();
+    for (auto it = fiting_tree.begin(); it != fiting_tree.end(); ++it)
+    {
+        if (it->deleted())
+            continue;
+        REQUIRE(expected_it != expected.end());
+        REQUIRE(it->key() == expected_it->first);
+        REQUIRE(it->pos() == expected_it->second);
+        ++expected_it;
+    }
+    REQUIRE(expected_it == expected.end());
+
+    for (auto &[key, pos] : expected)
+    {
+        auto it = fiting_tree.find(key);
+        REQUIRE(it != fiting_tree.end());
+        REQUIRE(it->pos() == pos);
+    }
+}
+
 TEMPLATE_TEST_CASE("Segmentation algorithm", "", float, double, uint32_t, uint64_t)
 {
     const auto error = GENERATE(32, 64, 128);
@@ -26,30 +115,144 @@ TEMPLATE_TEST_CASE("Segmentation algorithm", "", float, double, uint32_t, uint64
         RandomFunction uniform_sparse = std::bind(std::uniform_int_distribution<TestType>(0, 10000000), engine);
         RandomFunction binomial = std::bind(std::binomial_distribution<TestType>(50000), engine);
         RandomFunction geometric = std::bind(std::geometric_distribution<TestType>(0.8), engine);
-        auto rand = GENERATE_COPY(as<RandomFunction>{}, uniform_dense, uniform_sparse, binomial, geometric);
+        // Segments whose keys span more than 32 bits compare their slopes with wider products
+        RandomFunction uniform_wide = std::bind(std::uniform_int_distribution<TestType>(0, std::numeric_limits<TestType>::max()), engine);
+        auto rand = GENERATE_COPY(as<RandomFunction>{}, uniform_dense, uniform_sparse, binomial, geometric, uniform_wide);
         std::generate(data.begin(), data.end(), rand);
     }
 
     std::sort(data.begin(), data.end());
-    auto segments = get_all_segments(data.begin(), data.end(), error);
-    auto it = segments.begin();
-    auto [slope, intercept] = it->get_slope_intercept();
-
-    for (auto i = 0; i < data.size(); i++)
+    auto check_segments = [&](const auto &segments)
     {
-        if (i != 0 && data[i] == data[i - 1])
-            continue;
+        auto it = segments.begin();
+        auto [slope, intercept] = it->get_slope_intercept();
 
-        if (std::next(it) != segments.end() && std::next(it)->get_start_key() <= data[i])
+        for (size_t i = 0; i < data.size(); i++)
         {
-            ++it;
-            std::tie(slope, intercept) = it->get_slope_intercept();
+            if (i != 0 && data[i] == data[i - 1])
+                continue;
+
+            if (std::next(it) != segments.end() && std::next(it)->get_start_key() <= data[i])
+            {
+                ++it;
+                std::tie(slope, intercept) = it->get_slope_intercept();
+            }
+
+            auto pos = (data[i] - it->get_start_key()) * slope + intercept;
+            auto offset = std::fabs(i - pos);
+            REQUIRE(offset <= error + 1);
+
+            auto [below, above] = it->get_error_bounds();
+            auto predicted = it->predict(data[i]);
+            REQUIRE(predicted <= i + below);
+            REQUIRE(i <= predicted + above);
         }
+    };
+
+    auto segments = get_all_segments(data.begin(), data.end(), error);
+    check_segments(segments);
+
+    // The optimal segmentation meets the same error with no more segments
+    auto optimal = get_all_segments<OptimalPLA>(data.begin(), data.end(), error);
+    check_segments(optimal);
+    REQUIRE(optimal.size() <= segments.size());
+}
 
-        auto pos = (data[i] - it->get_start_key()) * slope + intercept;
-        auto offset = std::fabs(i - pos);
-        REQUIRE(offset <= error + 1);
+TEST_CASE("Segmentation of 32-bit keys and positions")
+{
+    // The slopes of the cone are compared with products of a 32-bit difference of keys and a 32-bit difference
+    // of positions, here both close to 2^32, which overflow 64 bits
+    PiecewiseLinearModel<uint32_t, uint32_t, double> plm(1);
+    REQUIRE(plm.add_point(0, 0));
+    REQUIRE(plm.add_point(1u << 31, 1u << 31));
+    REQUIRE(plm.add_point(std::numeric_limits<uint32_t>::max(), std::numeric_limits<uint32_t>::max()));
+    REQUIRE(plm.get_segment().get_slope_intercept().first == 1);
+
+    OptimalPiecewiseLinearModel<uint32_t, uint32_t, double> optimal(1);
+    REQUIRE(optimal.add_point(0, 0));
+    REQUIRE(optimal.add_point(1u << 31, 1u << 31));
+    REQUIRE(optimal.add_point(std::numeric_limits<uint32_t>::max(), std::numeric_limits<uint32_t>::max()));
+    REQUIRE(optimal.get_segment().get_slope_intercept().first == Approx(1));
+}
+
+TEST_CASE("Buffered segmentation")
+{
+    using segment_type = BufferedSegment<uint64_t, uint64_t, DefaultSlope<uint64_t>, 32>;
+    static_assert(std::is_copy_assignable_v<BufferedSegmenter<DefaultSlope<uint64_t>, segment_type>>);
+    static_assert(std::is_move_assignable_v<BufferedSegmenter<DefaultSlope<uint64_t>, segment_type>>);
+    static_assert(std::is_copy_assignable_v<BufferedSegmenter<DefaultSlope<uint64_t>, segment_type, OptimalPLA>>);
+    const auto max_length = GENERATE(size_t(50), std::numeric_limits<size_t>::max());
+
+    // Repeated keys stay in the segment of their first occurrence
+    std::mt19937 engine(42);
+    std::vector<uint64_t> data(100000);
+    std::generate(data.begin(), data.end(), [&engine] { return engine() % 50000; });
+    std::sort(data.begin(), data.end());
+    auto in = [&data](auto i) { return std::pair<uint64_t, uint64_t>(data[i], i); };
+
+    // Building the segments from the input directly matches pushing the keys one at a time
+    std::vector<segment_type> direct;
+    get_all_segments_buffered<DefaultSlope<uint64_t>, segment_type>(data.size(), 32, in, [&](auto s) { direct.push_back(std::move(s)); }, max_length);
+
+    std::vector<segment_type> streamed;
+    auto out = [&](auto s) { streamed.push_back(std::move(s)); };
+    BufferedSegmenter<DefaultSlope<uint64_t>, segment_type> segmenter(32, max_length);
+    for (size_t i = 0; i < data.size(); ++i)
+        segmenter.add(data[i], i, out);
+    segmenter.finish(out);
+
+    REQUIRE(direct.size() == streamed.size());
+    size_t total = 0;
+    for (size_t i = 0; i < direct.size(); ++i)
+    {
+        REQUIRE(direct[i].get_start_key() == streamed[i].get_start_key());
+        REQUIRE(direct[i].size() == streamed[i].size());
+        REQUIRE(std::equal(direct[i].begin(), direct[i].end(), streamed[i].begin(),
+                           [](auto a, auto b) { return a.key() == b.key() && a.pos() == b.pos(); }));
+        total += direct[i].size();
     }
+    REQUIRE(total == data.size());
+}
+
+TEMPLATE_TEST_CASE("Parallel segmentation", "",
+                   (std::tuple<uint32_t, ShrinkingCone>), (std::tuple<uint64_t, ShrinkingCone>),
+                   (std::tuple<uint32_t, OptimalPLA>), (std::tuple<uint64_t, OptimalPLA>))
+{
+    using T = std::tuple_element_t<0, TestType>;
+    using Segmentation = std::tuple_element_t<1, TestType>;
+
+    const auto threads = GENERATE(2, 3, 8);
+    std::vector<T> data(1000000);
+    std::mt19937 engine(42);
+    using RandomFunction = std::function<T()>;
+
+    RandomFunction uniform_dense = std::bind(std::uniform_int_distribution<T>(0, 10000), engine);
+    RandomFunction uniform_sparse = std::bind(std::uniform_int_distribution<T>(0, 10000000), engine);
+    RandomFunction geometric = std::bind(std::geometric_distribution<T>(0.8), engine);
+    auto rand = GENERATE_COPY(as<RandomFunction>{}, uniform_dense, uniform_sparse, geometric);
+    std::generate(data.begin(), data.end(), rand);
+    std::sort(data.begin(), data.end());
+
+    using pair_type = std::pair<T, size_t>;
+    using segment_type = Segment<T, size_t>;
+    auto in_fun = [&data](auto i) { return pair_type(data[i], i); };
+
+    std::vector<segment_type> sequential;
+    std::vector<segment_type> parallel;
+    get_all_segments<long double, Segmentation>(data.size(), 32, in_fun, [&](auto segment) { sequential.push_back(segment); });
+    auto num_segments = get_all_segments_parallel<long double, Segmentation>(data.size(), 32, threads, in_fun,
+                                                                            [&](auto segment) { parallel.push_back(segment); });
+
+    REQUIRE(num_segments == sequential.size());
+    REQUIRE(parallel.size() == sequential.size());
+    for (size_t i = 0; i < sequential.size(); ++i)
+    {
+        REQUIRE(parallel[i].get_start_key() == sequential[i].get_start_key());
+        REQUIRE(parallel[i].get_slope_intercept() == sequential[i].get_slope_intercept());
+    }
+
+    FitingTree<T, 32, DefaultSlope<T>, uint64_t, BTreeRouter<T>, Segmentation> fiting_tree(data, threads);
+    REQUIRE(fiting_tree.get_segments_count() == sequential.size());
 }
 
 TEMPLATE_TEST_CASE_SIG("Fiting-Tree Index", "",
@@ -95,6 +298,204 @@ TEMPLATE_TEST_CASE_SIG("Fiting-Tree Index", "",
     REQUIRE(std::lower_bound(lo, hi, q) == data.begin());
 }
 
+TEST_CASE("Fiting-Tree ranges of absent keys")
+{
+    // Every 97th key is repeated, so that the keys that are not indexed rank after runs of up to 100 keys
+    std::vector<uint32_t> data;
+    for (uint32_t k = 0; k < 100000; ++k)
+        data.insert(data.end(), k % 97 == 0 ? 100 : 1 + k % 3, k * 4);
+
+    FitingTree<uint32_t, 8> small_error(data);
+    FitingTree<uint32_t, 64> large_error(data);
+    for (uint32_t q = 0; q < 400004; ++q)
+    {
+        uint64_t pos = std::lower_bound(data.begin(), data.end(), q) - data.begin();
+        auto small_range = small_error.get_approx_pos(q);
+        REQUIRE(small_range.lo <= pos);
+        REQUIRE(pos <= small_range.hi);
+        auto large_range = large_error.get_approx_pos(q);
+        REQUIRE(large_range.lo <= pos);
+        REQUIRE(pos <= large_range.hi);
+    }
+}
+
+TEMPLATE_TEST_CASE("Fiting-Tree slope representations", "",
+                   (std::tuple<uint32_t, FixedPoint<uint32_t>, uint32_t>), (std::tuple<uint32_t, FixedPoint<uint64_t>, uint64_t>),
+                   (std::tuple<uint32_t, float, uint32_t>), (std::tuple<uint32_t, double, uint64_t>),
+                   (std::tuple<uint64_t, FixedPoint<uint64_t>, uint32_t>), (std::tuple<uint64_t, double, uint64_t>),
+                   (std::tuple<uint64_t, long double, uint64_t>))
+{
+    using T = std::tuple_element_t<0, TestType>;
+    using F = std::tuple_element_t<1, TestType>;
+    using P = std::tuple_element_t<2, TestType>;
+
+    std::vector<T> data(1000000);
+    std::mt19937 engine(42);
+
+    using RandomFunction = std::function<T()>;
+    RandomFunction uniform_dense = std::bind(std::uniform_int_distribution<T>(0, 10000), engine);
+    RandomFunction uniform_sparse = std::bind(std::uniform_int_distribution<T>(0, std::numeric_limits<T>::max()), engine);
+    RandomFunction binomial = std::bind(std::binomial_distribution<T>(50000), engine);
+    auto rand = GENERATE_COPY(as<RandomFunction>{}, uniform_dense, uniform_sparse, binomial);
+
+    std::generate(data.begin(), data.end(), rand);
+    std::sort(data.begin(), data.end());
+    FitingTree<T, 32, F, P> fiting_tree(data);
+
+    for (size_t i = 0; i < data.size(); i += 7)
+    {
+        auto q = data[i];
+        auto approx_range = fiting_tree.get_approx_pos(q);
+        size_t pos = std::lower_bound(data.begin(), data.end(), q) - data.begin();
+        REQUIRE(approx_range.lo <= pos);
+        REQUIRE(pos < approx_range.hi);
+    }
+}
+
+TEMPLATE_TEST_CASE_SIG("Fiting-Tree routers", "",
+                       ((typename T, size_t E), T, E),
+                       (uint32_t, 8), (uint32_t, 64), (uint64_t, 8), (uint64_t, 64))
+{
+    std::vector<T> data(2000000);
+    std::mt19937 engine(42);
+
+    using RandomFunction = std::function<T()>;
+    RandomFunction uniform_dense = std::bind(std::uniform_int_distribution<T>(0, 10000), engine);
+    RandomFunction uniform_sparse = std::bind(std::uniform_int_distribution<T>(0, std::numeric_limits<T>::max()), engine);
+    RandomFunction lognormal = [&engine] { return T(std::lognormal_distribution<double>(0, 2)(engine) * 1000000); };
+    auto rand = GENERATE_COPY(as<RandomFunction>{}, uniform_dense, uniform_sparse, lognormal);
+
+    std::generate(data.begin(), data.end(), rand);
+    std::sort(data.begin(), data.end());
+    FitingTree<T, E> btree_routed(data);
+    FitingTree<T, E, DefaultSlope<T>, uint64_t, LearnedRouter<T, 4>> learned_routed(data);
+    FitingTree<T, E, DefaultSlope<T>, uint64_t, FlatRouter<T>> flat_routed(data);
+
+    for (auto i = 1; i <= 100000; ++i)
+    {
+        auto q = i % 2 ? data[std::rand() % data.size()] : T(std::rand());
+        auto expected = btree_routed.get_approx_pos(q);
+
+        auto approx_range = learned_routed.get_approx_pos(q);
+        REQUIRE(approx_range.pos == expected.pos);
+        REQUIRE(approx_range.lo == expected.lo);
+        REQUIRE(approx_range.hi == expected.hi);
+
+        auto flat_range = flat_routed.get_approx_pos(q);
+        REQUIRE(flat_range.pos == expected.pos);
+        REQUIRE(flat_range.lo == expected.lo);
+        REQUIRE(flat_range.hi == expected.hi);
+    }
+
+    auto q = std::numeric_limits<T>::max();
+    REQUIRE(flat_routed.get_approx_pos(q).pos == btree_routed.get_approx_pos(q).pos);
+    REQUIRE(learned_routed.get_approx_pos(q).pos == btree_routed.get_approx_pos(q).pos);
+}
+
+TEMPLATE_TEST_CASE("Batched lookups", "", uint32_t, uint64_t)
+{
+    std::vector<TestType> data(1000000);
+    std::mt19937 engine(42);
+    std::uniform_int_distribution<TestType> distribution(1000, 1000000000);
+    std::generate(data.begin(), data.end(), [&] { return distribution(engine); });
+    std::sort(data.begin(), data.end());
+
+    std::vector<TestType> queries(10007);
+    std::generate(queries.begin(), queries.end(), [&] { return engine() % 2 ? data[engine() % data.size()] : TestType(engine()); });
+    queries.push_back(0);
+    queries.push_back(std::numeric_limits<TestType>::max());
+
+    auto check_batch = [&](const auto &fiting_tree) {
+        using approx_pos_type = decltype(fiting_tree.get_approx_pos(queries[0]));
+        std::vector<approx_pos_type> results(queries.size());
+        fiting_tree.get_approx_pos_batch(queries.begin(), queries.end(), results.begin());
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            auto expected = fiting_tree.get_approx_pos(queries[i]);
+            REQUIRE(results[i].pos == expected.pos);
+            REQUIRE(results[i].lo == expected.lo);
+            REQUIRE(results[i].hi == expected.hi);
+        }
+
+        auto sorted_queries = queries;
+        std::sort(sorted_queries.begin(), sorted_queries.end());
+        fiting_tree.get_approx_pos_sorted(sorted_queries.begin(), sorted_queries.end(), results.begin());
+        for (size_t i = 0; i < sorted_queries.size(); ++i)
+        {
+            auto expected = fiting_tree.get_approx_pos(sorted_queries[i]);
+            REQUIRE(results[i].pos == expected.pos);
+            REQUIRE(results[i].lo == expected.lo);
+            REQUIRE(results[i].hi == expected.hi);
+        }
+    };
+
+    check_batch(FitingTree<TestType, 32>(data));
+    check_batch(FitingTree<TestType, 32, DefaultSlope<TestType>, uint64_t, LearnedRouter<TestType, 4>>(data));
+    check_batch(FitingTree<TestType, 32, DefaultSlope<TestType>, uint64_t, FlatRouter<TestType>>(data));
+
+    BufferedFitingTree<TestType, uint32_t> buffered_fiting_tree(data);
+    for (auto i = 0; i < 10000; ++i)
+        buffered_fiting_tree.insert(TestType(distribution(engine)), i);
+
+    std::vector<typename BufferedFitingTree<TestType, uint32_t>::iterator> found(queries.size());
+    buffered_fiting_tree.find_batch(queries.begin(), queries.end(), found.begin());
+    for (size_t i = 0; i < queries.size(); ++i)
+        REQUIRE((found[i] == buffered_fiting_tree.find(queries[i])));
+}
+
+TEMPLATE_TEST_CASE("Last-mile search kernels", "", BinarySearch, ExponentialSearch, LinearSearch, InterpolationSearch)
+{
+    std::mt19937 engine(42);
+
+    auto check_kernel = [&engine](auto fiting_tree, const auto &data) {
+        using T = typename std::decay_t<decltype(data)>::value_type;
+        for (auto i = 0; i < 100000; ++i)
+        {
+            auto q = i % 2 ? data[engine() % data.size()] : T(engine());
+            auto expected = std::lower_bound(data.begin(), data.end(), q);
+            REQUIRE(fiting_tree.template lower_bound<TestType>(data.begin(), q) == expected);
+            auto found = expected != data.end() && *expected == q ? expected : data.end();
+            REQUIRE(fiting_tree.template find<TestType>(data.begin(), q) == found);
+        }
+
+        auto q = std::numeric_limits<T>::max();
+        REQUIRE(fiting_tree.template lower_bound<TestType>(data.begin(), q) == std::lower_bound(data.begin(), data.end(), q));
+        REQUIRE(fiting_tree.template lower_bound<TestType>(data.begin(), T(0)) == data.begin());
+    };
+
+    std::vector<uint32_t> data32(1000000);
+    std::generate(data32.begin(), data32.end(), [&] { return 1 + engine() % 1000000000; });
+    std::sort(data32.begin(), data32.end());
+    check_kernel(FitingTree<uint32_t, 8>(data32), data32);
+    check_kernel(FitingTree<uint32_t, 64>(data32), data32);
+
+    std::vector<uint64_t> data64(1000000);
+    std::generate(data64.begin(), data64.end(), [&] { return 1 + uint64_t(std::lognormal_distribution<double>(0, 2)(engine) * 1000000); });
+    std::sort(data64.begin(), data64.end());
+    check_kernel(FitingTree<uint64_t, 8>(data64), data64);
+    check_kernel(FitingTree<uint64_t, 64>(data64), data64);
+
+    // A key that is not indexed ranks after the whole run of the key before it, past the model of the run
+    std::vector<uint32_t> repeated;
+    for (uint32_t k = 0; k < 100000; ++k)
+        repeated.insert(repeated.end(), k % 97 == 0 ? 500 : 1, k * 4);
+    FitingTree<uint32_t, 8> fiting_tree(repeated);
+    for (uint32_t q = 0; q < 400004; ++q)
+    {
+        auto expected = std::lower_bound(repeated.begin(), repeated.end(), q);
+        REQUIRE(fiting_tree.lower_bound<TestType>(repeated.begin(), q) == expected);
+        auto found = expected != repeated.end() && *expected == q ? expected : repeated.end();
+        REQUIRE(fiting_tree.find<TestType>(repeated.begin(), q) == found);
+    }
+}
+
+TEST_CASE("Segment footprint")
+{
+    STATIC_REQUIRE(sizeof(Segment<uint32_t, uint32_t, float>) == 20);
+    STATIC_REQUIRE(sizeof(Segment<uint32_t, uint64_t, FixedPoint<uint32_t>>) == 32);
+    STATIC_REQUIRE(sizeof(Segment<uint64_t, uint64_t, double>) == 40);
+}
+
 TEST_CASE("Buffered Fiting-Tree Iterator")
 {
     std::srand(42);
@@ -112,6 +513,14 @@ TEST_CASE("Buffered Fiting-Tree Iterator")
         REQUIRE(it->key() == bulk[i]);
         i += 1;
     }
+
+    for (size_t j = 0; j < bulk.size(); j += 3)
+        fiting_tree.erase(bulk[j]);
+
+    size_t live = 0;
+    for (auto it = fiting_tree.begin(); it != fiting_tree.end(); ++it)
+        live += !it->deleted();
+    REQUIRE(live == bulk.size() - (bulk.size() + 2) / 3);
 }
 
 TEMPLATE_TEST_CASE("Buffered FITing-Tree Index", "", uint32_t, uint64_t)
@@ -148,5 +557,327 @@ TEMPLATE_TEST_CASE("Buffered FITing-Tree Index", "", uint32_t, uint64_t)
 
         auto it = fiting_tree.find(q);
         REQUIRE(it == fiting_tree.end());
+
+        fiting_tree.insert(q, i);
+        it = fiting_tree.find(q);
+        REQUIRE(it->key() == q);
+        REQUIRE(it->pos() == i);
+
+        fiting_tree.erase(q);
+        REQUIRE(fiting_tree.find(q) == fiting_tree.end());
+    }
+
+    for (TestType i = 1; i <= 1000; ++i)
+    {
+        auto q = bulk[std::rand() % bulk.size()];
+        fiting_tree.erase(q);
+        REQUIRE(fiting_tree.insert(q, i));
+        REQUIRE_FALSE(fiting_tree.insert(q, i + 1));
+        REQUIRE(fiting_tree.find(q)->pos() == i);
+        REQUIRE_FALSE(fiting_tree.insert_or_assign(q, i + 2));
+        REQUIRE(fiting_tree.find(q)->pos() == i + 2);
+        fiting_tree.upsert(q, i + 3);
+        REQUIRE(fiting_tree.find(q)->pos() == i + 3);
+    }
+
+    auto q = bulk.front() - 1;
+    fiting_tree.insert(q, 0);
+    REQUIRE(fiting_tree.find(q)->key() == q);
+    REQUIRE(fiting_tree.lower_bound(0)->key() == q);
+
+    // The buffers merged in the segments keep the keys sorted
+    auto prev = fiting_tree.begin();
+    for (auto it = std::next(prev); it != fiting_tree.end(); prev = it++)
+        REQUIRE(!(it->key() < prev->key()));
+
+    // An empty index builds its first segment from the first key written to it
+    BufferedFitingTree<uint32_t, TestType> empty;
+    REQUIRE(empty.find(7) == empty.end());
+    REQUIRE(empty.insert(7, 1));
+    REQUIRE(empty.find(7)->pos() == 1);
+
+    BufferedFitingTree<uint32_t, TestType> empty_assigned(std::vector<uint32_t>{});
+    REQUIRE(empty_assigned.insert_or_assign(7, 1));
+    REQUIRE(empty_assigned.find(7)->pos() == 1);
+
+    BufferedFitingTree<uint32_t, TestType> empty_upserted(std::vector<uint32_t>{});
+    empty_upserted.upsert(7, 1);
+    empty_upserted.upsert(7, 2);
+    REQUIRE(empty_upserted.find(7)->pos() == 2);
+
+    for (TestType k = 0; k < 1000; ++k)
+        REQUIRE(empty_upserted.insert(3 * k, k));
+    for (TestType k = 0; k < 1000; ++k)
+        REQUIRE(empty_upserted.find(3 * k)->pos() == k);
+    REQUIRE(std::distance(empty_upserted.begin(), empty_upserted.end()) == 1001);
+}
+
+TEST_CASE("Gapped FITing-Tree Index")
+{
+    std::srand(42);
+    auto gen = [] { return std::rand() % 1000000000; };
+    auto bulk = make_bulk<uint32_t>(100000, gen);
+
+    using segment_type = GappedSegment<uint32_t, uint32_t, DefaultSlope<uint32_t>>;
+    BufferedFitingTree<uint32_t, uint32_t, 64, 32, DefaultSlope<uint32_t>, segment_type> fiting_tree(bulk);
+    auto expected = make_expected(bulk);
+
+    // Enough inserts to fill the gaps of every segment and expand it several times
+    run_random_writes(fiting_tree, expected, gen, 200000, 0);
+
+    for (auto i = 1; i <= 1000; ++i)
+    {
+        auto q = bulk[std::rand() % bulk.size()];
+        fiting_tree.erase(q);
+        expected.erase(q);
+        REQUIRE(fiting_tree.find(q) == fiting_tree.end());
+    }
+
+    check_contents(fiting_tree, expected);
+}
+
+TEST_CASE("Buffered FITing-Tree Compaction")
+{
+    std::srand(42);
+    auto bulk = make_bulk<uint32_t>(100000, [] { return std::rand() % 1000000000; });
+
+    BufferedFitingTree<uint32_t, uint32_t> fiting_tree(bulk);
+
+    for (size_t i = 0; i < bulk.size(); ++i)
+        if (i % 4 != 0)
+            REQUIRE(fiting_tree.erase(bulk[i]));
+    REQUIRE_FALSE(fiting_tree.erase(bulk[1]));
+
+    // The segments with many deleted items were rebuilt without them
+    size_t stored = std::distance(fiting_tree.begin(), fiting_tree.end());
+    REQUIRE(stored < bulk.size() / 2);
+
+    auto segments = fiting_tree.get_segments_count();
+    fiting_tree.compact();
+    REQUIRE(fiting_tree.get_segments_count() <= segments);
+
+    size_t i = 0;
+    for (auto it = fiting_tree.begin(); it != fiting_tree.end(); ++it, i += 4)
+    {
+        REQUIRE_FALSE(it->deleted());
+        REQUIRE(it->key() == bulk[i]);
+        REQUIRE(fiting_tree.find(bulk[i])->pos() == i);
+    }
+    REQUIRE(i >= bulk.size());
+}
+
+TEST_CASE("Buffered FITing-Tree Segment Size Cap")
+{
+    // Linear keys fit a single segment, which the cap splits
+    std::vector<uint64_t> bulk(10000);
+    for (size_t i = 0; i < bulk.size(); ++i)
+        bulk[i] = 10 * i;
+
+    REQUIRE(BufferedFitingTree<uint64_t, uint64_t>(bulk).get_segments_count() == 1);
+
+    BufferedFitingTree<uint64_t, uint64_t> fiting_tree(bulk, 100);
+    REQUIRE(fiting_tree.get_segments_count() == bulk.size() / 100);
+
+    for (uint64_t key = 5; key < 10 * bulk.size(); key += 20)
+        REQUIRE(fiting_tree.insert(key, key));
+
+    // Every segment stores at most 100 keys besides its buffer
+    size_t total = bulk.size() + bulk.size() / 2;
+    REQUIRE(fiting_tree.get_segments_count() >= total / (100 + decltype(fiting_tree)::buffer_size));
+
+    for (size_t i = 0; i < bulk.size(); ++i)
+    {
+        REQUIRE(fiting_tree.find(bulk[i])->pos() == i);
+        if (i % 2 == 0)
+            REQUIRE(fiting_tree.find(bulk[i] + 5)->pos() == bulk[i] + 5);
     }
-}
\ No newline at end of file
+
+    // A key repeated more times than the cap ends its segment at the first point, which keeps a line of its own
+    std::vector<uint64_t> repeated;
+    for (uint64_t k = 0; k < 2000; ++k)
+        repeated.insert(repeated.end(), k % 10 == 0 ? 300 : 1, 7 * k);
+
+    using segment_type = BufferedSegment<uint64_t, uint64_t, double, 32>;
+    auto in = [&repeated](size_t i) { return std::pair<uint64_t, uint64_t>(repeated[i], i); };
+    size_t start = 0;
+    auto check_segment = [&](auto segment) {
+        auto [slope, intercept] = segment.get_slope_intercept();
+        REQUIRE(std::isfinite(slope));
+        for (size_t i = start; i < start + segment.size(); ++i)
+            if (i == start || repeated[i] != repeated[i - 1])
+                REQUIRE(std::fabs((repeated[i] - segment.get_start_key()) * slope + intercept - i) <= 33);
+        start += segment.size();
+    };
+    get_all_segments_buffered<double, segment_type>(repeated.size(), 32, in, check_segment, 100);
+    start = 0;
+    get_all_segments_buffered<double, segment_type, OptimalPLA>(repeated.size(), 32, in, check_segment, 100);
+
+    BufferedFitingTree<uint64_t, uint64_t, 64, 32, double, segment_type> capped(repeated, 100);
+    BufferedFitingTree<uint64_t, uint64_t, 64, 32, double, segment_type, OptimalPLA> capped_optimal(repeated, 100);
+    for (uint64_t k = 0; k < 2000; ++k)
+    {
+        REQUIRE(capped.find(7 * k) != capped.end());
+        REQUIRE(capped.insert(7 * k + 3, k));
+        REQUIRE(capped_optimal.find(7 * k) != capped_optimal.end());
+        REQUIRE(capped_optimal.insert(7 * k + 3, k));
+    }
+}
+
+TEMPLATE_TEST_CASE("Buffered FITing-Tree Incremental and Background Merges", "",
+                   (BufferedSegment<uint32_t, uint32_t, DefaultSlope<uint32_t>, 32>),
+                   (GappedSegment<uint32_t, uint32_t, DefaultSlope<uint32_t>>))
+{
+    std::srand(42);
+    auto gen = [] { return std::rand() % 10000000; };
+    auto bulk = make_bulk<uint32_t>(20000, gen);
+
+    BufferedFitingTree<uint32_t, uint32_t, 64, 32, DefaultSlope<uint32_t>, TestType> fiting_tree(bulk);
+    SECTION("Incremental")
+    {
+        fiting_tree.set_merge_step(16);
+    }
+    SECTION("Background")
+    {
+        fiting_tree.set_background_merges(2);
+    }
+
+    auto expected = make_expected(bulk);
+    run_random_writes(fiting_tree, expected, gen, 50000, 5);
+
+    // Finishes the pending merges, if any
+    fiting_tree.set_merge_step(0);
+    fiting_tree.set_background_merges(0);
+    check_contents(fiting_tree, expected);
+}
+
+TEMPLATE_TEST_CASE("Buffered FITing-Tree Copy and Move", "",
+                   (BufferedSegment<uint32_t, uint32_t, DefaultSlope<uint32_t>, 32>),
+                   (GappedSegment<uint32_t, uint32_t, DefaultSlope<uint32_t>>))
+{
+    using tree_type = BufferedFitingTree<uint32_t, uint32_t, 64, 32, DefaultSlope<uint32_t>, TestType>;
+
+    std::srand(42);
+    auto gen = [] { return std::rand() % 10000000; };
+    auto bulk = make_bulk<uint32_t>(20000, gen);
+
+    tree_type fiting_tree(bulk);
+    SECTION("Incremental")
+    {
+        fiting_tree.set_merge_step(16);
+    }
+    SECTION("Background")
+    {
+        fiting_tree.set_background_merges(2);
+    }
+
+    auto expected = make_expected(bulk);
+    run_random_writes(fiting_tree, expected, gen, 20000, 4);
+
+    // The copies drop the merges in progress, which the moves take along
+    tree_type copied(fiting_tree);
+    tree_type assigned;
+    assigned = fiting_tree;
+    check_contents(assigned, expected);
+
+    auto copied_expected = expected;
+    run_random_writes(fiting_tree, expected, gen, 20000, 4);
+    run_random_writes(copied, copied_expected, gen, 20000, 4);
+    check_contents(copied, copied_expected);
+
+    tree_type moved(std::move(fiting_tree));
+    REQUIRE(fiting_tree.begin() == fiting_tree.end());
+    REQUIRE(fiting_tree.find(bulk.front()) == fiting_tree.end());
+
+    fiting_tree = std::move(moved);
+    run_random_writes(fiting_tree, expected, gen, 20000, 4);
+    fiting_tree.set_merge_step(0);
+    fiting_tree.set_background_merges(0);
+    check_contents(fiting_tree, expected);
+}
+
+TEMPLATE_TEST_CASE("Buffered FITing-Tree Optimal Segmentation", "",
+                   (BufferedSegment<uint64_t, uint64_t, DefaultSlope<uint64_t>, 32>),
+                   (GappedSegment<uint64_t, uint64_t, DefaultSlope<uint64_t>>))
+{
+    std::mt19937_64 engine(42);
+    std::lognormal_distribution<double> lognormal(0, 2);
+    auto gen = [&] { return uint64_t(lognormal(engine) * 1000000); };
+
+    auto bulk = make_bulk<uint64_t>(100000, gen);
+
+    BufferedFitingTree<uint64_t, uint64_t, 64, 32, DefaultSlope<uint64_t>, TestType> greedy(bulk);
+    BufferedFitingTree<uint64_t, uint64_t, 64, 32, DefaultSlope<uint64_t>, TestType, OptimalPLA> fiting_tree(bulk);
+    REQUIRE(fiting_tree.get_segments_count() <= greedy.get_segments_count());
+
+    auto expected = make_expected(bulk);
+    run_random_writes(fiting_tree, expected, gen, 100000, 4);
+    check_contents(fiting_tree, expected);
+}
+
+TEMPLATE_TEST_CASE("Buffered FITing-Tree Allocator", "",
+                   (BufferedSegment<uint64_t, uint64_t, DefaultSlope<uint64_t>, 32, std::pmr::polymorphic_allocator<uint64_t>>),
+                   (GappedSegment<uint64_t, uint64_t, DefaultSlope<uint64_t>, std::pmr::polymorphic_allocator<uint64_t>>))
+{
+    // Counts the allocations reaching the heap
+    struct CountingResource : std::pmr::memory_resource
+    {
+        size_t allocations = 0;
+
+        void *do_allocate(size_t bytes, size_t alignment) override
+        {
+            ++allocations;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override
+        {
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+    };
+
+    std::srand(42);
+    auto gen = [] { return std::rand() % 1000000; };
+    auto bulk = make_bulk<uint64_t>(10000, gen);
+
+    CountingResource heap;
+    SizeClassPool pool(&heap);
+    auto run = [&](size_t background_merges) {
+        BufferedFitingTree<uint64_t, uint64_t, 64, 32, DefaultSlope<uint64_t>, TestType> fiting_tree(bulk, 256, &pool);
+        fiting_tree.set_background_merges(background_merges);
+
+        auto expected = make_expected(bulk);
+        run_random_writes(fiting_tree, expected, gen, 20000, 3);
+        fiting_tree.set_background_merges(0);
+        fiting_tree.compact();
+        check_contents(fiting_tree, expected);
+    };
+
+    SECTION("Synchronous merges")
+    {
+        run(0);
+    }
+    SECTION("Background merges")
+    {
+        run(2);
+    }
+
+    // A copy can be given its own resource
+    using tree_type = BufferedFitingTree<uint64_t, uint64_t, 64, 32, DefaultSlope<uint64_t>, TestType>;
+    static_assert(std::is_copy_assignable_v<tree_type> && std::is_move_assignable_v<tree_type>);
+    {
+        tree_type fiting_tree(bulk, 256, &pool);
+        tree_type copied(fiting_tree, std::pmr::new_delete_resource());
+        tree_type moved(std::move(copied));
+        fiting_tree = std::move(moved);
+        REQUIRE(std::equal(fiting_tree.begin(), fiting_tree.end(), bulk.begin(), bulk.end(),
+                           [](auto item, auto key) { return item.key() == key; }));
+    }
+
+    // The memory of the destroyed index is recycled by the pool
+    size_t allocations = heap.allocations;
+    REQUIRE(allocations > 0);
+    BufferedFitingTree<uint64_t, uint64_t, 64, 32, DefaultSlope<uint64_t>, TestType> fiting_tree(bulk, 256, &pool);
+    REQUIRE(heap.allocations == allocations);
+}